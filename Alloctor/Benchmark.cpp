@@ -1,117 +1,504 @@
 #include "Common.h"
 #include "ConcurrentAlloc.h"
+#include "list.h"
+#include "map.h"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <list>
+#include <map>
+#include <random>
 
-// #define SHOWTIME
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 
-static std::pair<size_t, size_t> BenchmarkMalloc(size_t ntimes, size_t nworks, size_t rounds,size_t mem_size)
+// 多线程分配器基准测试
+// 用法：benchmark [-t 线程数] [-n 每个线程的操作次数] [-s 大小分布文件]
+// 大小分布文件每行是"大小 次数"(或者只有大小，次数为1)，不指定时用内置的分布
+//
+// 每个场景分别用ConcurrentAlloc(ThreadCache和CpuCache两种前端)和系统malloc跑一遍，输出吞吐、延迟分位数和RSS的增长
+// 时间都是steady_clock的墙上时间，每个线程单独计时，最后汇总，不共享计数
+
+typedef std::chrono::steady_clock Clock;
+
+const size_t LATENCY_SAMPLE = 16; //每多少次操作记录一次延迟
+
+static size_t NowNs()
+{
+	return (size_t)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+// 当前进程的常驻内存，取不到时返回0
+static size_t CurrentRss()
 {
-	std::vector<std::thread> vthread(nworks);
-	size_t malloc_costtime = 0;
-	size_t free_costtime = 0;
-	for (size_t k = 0; k < nworks; ++k)
+#ifdef _WIN32
+	return 0;
+#else
+	FILE* fp = fopen("/proc/self/statm", "r");
+	if (fp == nullptr)
+		return 0;
+	size_t pages = 0, resident = 0;
+	if (fscanf(fp, "%zu %zu", &pages, &resident) != 2)
+		resident = 0;
+	fclose(fp);
+	return resident * (size_t)sysconf(_SC_PAGESIZE);
+#endif
+}
+
+// 场景运行期间在后台定时采样RSS，记录峰值
+class RssMonitor
+{
+public:
+	RssMonitor()
+		: _start(CurrentRss()), _peak(_start)
 	{
-		vthread[k] = std::thread([&, k]() {
-			std::vector<void*> v;
-			v.reserve(ntimes);
-			for (size_t j = 0; j < rounds; ++j)
+		_thread = std::thread([this]() {
+			std::unique_lock<std::mutex> lock(_mutex);
+			while (!_stop)
 			{
-				size_t begin1 = clock();
-				for (size_t i = 0; i < ntimes; i++)
-				{
-					v.push_back(malloc(mem_size));
-				}
-				size_t end1 = clock();
-				size_t begin2 = clock();
-				for (size_t i = 0; i < ntimes; i++)
-				{
-					free(v[i]);
-				}
-				size_t end2 = clock();
-				v.clear();
-				malloc_costtime += end1 - begin1;
-				free_costtime += end2 - begin2;
+				size_t rss = CurrentRss();
+				if (rss > _peak)
+					_peak = rss;
+				_cond.wait_for(lock, std::chrono::milliseconds(5));
 			}
 		});
 	}
-	for (size_t k = 0; k < nworks; ++k) vthread[k].join();
 
-#ifdef SHOWTIME
-	printf("%lu个线程并发执行%lu轮次，每轮次malloc %lu次: 花费：%lu ms\n", nworks, rounds, ntimes, malloc_costtime);
-	printf("%lu个线程并发执行%lu轮次，每轮次free %lu次: 花费：%lu ms\n", nworks, rounds, ntimes, free_costtime);
-	printf("%lu个线程并发malloc&free %lu次，总计花费：%lu ms\n", nworks, nworks*rounds*ntimes, malloc_costtime + free_costtime);
-#endif // SHOWTIME
+	// 返回峰值相对开始时的增长
+	size_t Stop()
+	{
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_stop = true;
+		}
+		_cond.notify_one();
+		_thread.join();
+		size_t rss = CurrentRss();
+		if (rss > _peak)
+			_peak = rss;
+		return _peak - _start;
+	}
+
+private:
+	size_t _start;
+	size_t _peak;
+	bool _stop = false;
+	std::mutex _mutex;
+	std::condition_variable _cond;
+	std::thread _thread;
+};
+
+// 两种被测的分配器，接口一样，场景按模板参数实例化
+struct PoolApi
+{
+	static const char* Name() { return "ConcurrentAlloc"; }
+	static void* Alloc(size_t size) { return ConcurrentAlloc(size); }
+	static void Free(void* ptr, size_t size) { ConcurrentFree(ptr, size); }
+};
+
+//同样走ConcurrentAlloc，跑之前切到CpuCache前端
+struct CpuPoolApi : PoolApi
+{
+	static const char* Name() { return "ConcurrentAlloc/cpu"; }
+};
+
+struct MallocApi
+{
+	static const char* Name() { return "malloc"; }
+	static void* Alloc(size_t size) { return malloc(size); }
+	static void Free(void* ptr, size_t) { free(ptr); }
+};
+
+// 大小分布，按累计次数做二分查找抽样
+class SizeDist
+{
+public:
+	void Add(size_t size, size_t count)
+	{
+		if (size == 0 || count == 0)
+			return;
+		_sizes.push_back(size);
+		_total += count;
+		_cumulative.push_back(_total);
+	}
+
+	bool Empty() const { return _sizes.empty(); }
+
+	size_t Sample(std::mt19937_64& rng) const
+	{
+		size_t r = rng() % _total;
+		size_t i = std::upper_bound(_cumulative.begin(), _cumulative.end(), r) - _cumulative.begin();
+		return _sizes[i];
+	}
+
+	bool Load(const char* path)
+	{
+		std::ifstream in(path);
+		if (!in)
+			return false;
+		std::string line;
+		while (std::getline(in, line))
+		{
+			size_t size = 0, count = 1;
+			if (sscanf(line.c_str(), "%zu %zu", &size, &count) >= 1)
+				Add(size, count);
+		}
+		return !Empty();
+	}
+
+	// 内置分布：大部分是小对象，少量中等对象，偶尔有大对象
+	static SizeDist Default()
+	{
+		SizeDist dist;
+		size_t sizes[] = { 8, 16, 24, 32, 48, 64, 96, 128, 256, 512, 1024, 4096, 16 * 1024, 64 * 1024, 256 * 1024 };
+		size_t counts[] = { 60, 120, 80, 120, 60, 100, 40, 50, 30, 20, 10, 5, 2, 1, 1 };
+		for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+			dist.Add(sizes[i], counts[i]);
+		return dist;
+	}
+
+private:
+	std::vector<size_t> _sizes;
+	std::vector<size_t> _cumulative;
+	size_t _total = 0;
+};
+
+// 每个线程自己的结果，线程结束后再合并
+struct ThreadResult
+{
+	size_t _ops = 0;
+	std::vector<uint32_t> _latency; //采样的单次操作延迟(纳秒)
+};
+
+struct Result
+{
+	double _seconds = 0;
+	size_t _ops = 0;
+	size_t _p50 = 0, _p99 = 0, _p999 = 0;
+	size_t _rss = 0;
+};
+
+static Result Summarize(std::vector<ThreadResult>& results, double seconds, size_t rss)
+{
+	Result result;
+	result._seconds = seconds;
+	result._rss = rss;
 
-	return std::make_pair(malloc_costtime, free_costtime);
+	std::vector<uint32_t> latency;
+	for (ThreadResult& r : results)
+	{
+		result._ops += r._ops;
+		latency.insert(latency.end(), r._latency.begin(), r._latency.end());
+	}
+	if (!latency.empty())
+	{
+		std::sort(latency.begin(), latency.end());
+		result._p50 = latency[latency.size() * 50 / 100];
+		result._p99 = latency[latency.size() * 99 / 100];
+		result._p999 = latency[latency.size() * 999 / 1000];
+	}
+	return result;
 }
 
-// 单轮次申请释放次数 线程数 轮次
-static std::pair<size_t,size_t> BenchmarkConcurrentMalloc(size_t ntimes, size_t nworks, size_t rounds, size_t mem_size)
+static void Print(const char* scenario, const char* name, const Result& result)
 {
-	std::vector<std::thread> vthread(nworks);
-	size_t malloc_costtime = 0;
-	size_t free_costtime = 0;
-	for (size_t k = 0; k < nworks; ++k)
+	printf("%-22s %-19s %10.2f Mops/s  p50 %6zu ns  p99 %7zu ns  p99.9 %8zu ns  rss +%8.1f MiB\n",
+		scenario, name, result._ops / result._seconds / 1e6,
+		result._p50, result._p99, result._p999, result._rss / (1024.0 * 1024.0));
+}
+
+// 启动nthreads个线程执行work(线程号, 结果)，统计总耗时
+template <class Work>
+static Result RunThreads(size_t nthreads, Work work)
+{
+	std::vector<ThreadResult> results(nthreads);
+	std::vector<std::thread> threads;
+	RssMonitor rss;
+	size_t begin = NowNs();
+	for (size_t k = 0; k < nthreads; ++k)
+	{
+		threads.push_back(std::thread([&, k]() {
+			work(k, results[k]);
+		}));
+	}
+	for (auto& t : threads)
+		t.join();
+	double seconds = (NowNs() - begin) / 1e9;
+	return Summarize(results, seconds, rss.Stop());
+}
+
+// larson：每个线程维护一组槽位，随机选一个槽位释放旧对象、申请新对象
+template <class Api>
+static Result BenchLarson(size_t nthreads, size_t ops, size_t minsize, size_t maxsize)
+{
+	const size_t SLOTS = 1000;
+	return RunThreads(nthreads, [=](size_t k, ThreadResult& result) {
+		std::mt19937_64 rng(k + 1);
+		std::vector<void*> ptrs(SLOTS, nullptr);
+		std::vector<size_t> sizes(SLOTS, 0);
+		result._latency.reserve(ops / LATENCY_SAMPLE + 1);
+
+		for (size_t i = 0; i < ops; ++i)
+		{
+			size_t slot = rng() % SLOTS;
+			size_t size = minsize + rng() % (maxsize - minsize + 1);
+			bool timed = (i % LATENCY_SAMPLE) == 0;
+			size_t begin = timed ? NowNs() : 0;
+
+			if (ptrs[slot] != nullptr)
+				Api::Free(ptrs[slot], sizes[slot]);
+			ptrs[slot] = Api::Alloc(size);
+			sizes[slot] = size;
+			*(char*)ptrs[slot] = (char)i; //碰一下内存，避免只测到地址计算
+
+			if (timed)
+				result._latency.push_back((uint32_t)(NowNs() - begin));
+		}
+		for (size_t i = 0; i < SLOTS; ++i)
+		{
+			if (ptrs[i] != nullptr)
+				Api::Free(ptrs[i], sizes[i]);
+		}
+		result._ops = ops;
+	});
+}
+
+// 生产者消费者：一半线程申请后整批交给另一半线程释放，所有释放都是跨线程的
+template <class Api>
+static Result BenchProducerConsumer(size_t nthreads, size_t ops, const SizeDist& dist)
+{
+	const size_t BATCH = 256;
+	struct Batch
 	{
-		vthread[k] = std::thread([&]() {
-			std::vector<void*> v;
-			v.reserve(ntimes);
-			for (size_t j = 0; j < rounds; ++j)
+		void* _ptrs[BATCH];
+		size_t _sizes[BATCH];
+	};
+
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::deque<Batch*> queue;
+	size_t producers = nthreads / 2 > 0 ? nthreads / 2 : 1;
+	size_t running = producers;
+
+	return RunThreads(producers * 2, [&](size_t k, ThreadResult& result) {
+		result._latency.reserve(ops / LATENCY_SAMPLE + 1);
+		if (k < producers)
+		{
+			std::mt19937_64 rng(k + 1);
+			for (size_t i = 0; i < ops; i += BATCH)
+			{
+				Batch* batch = new Batch;
+				for (size_t j = 0; j < BATCH; ++j)
+				{
+					size_t size = dist.Sample(rng);
+					bool timed = (j % LATENCY_SAMPLE) == 0;
+					size_t begin = timed ? NowNs() : 0;
+					batch->_ptrs[j] = Api::Alloc(size);
+					if (timed)
+						result._latency.push_back((uint32_t)(NowNs() - begin));
+					batch->_sizes[j] = size;
+				}
+				result._ops += BATCH;
+
+				std::unique_lock<std::mutex> lock(mutex);
+				queue.push_back(batch);
+				cond.notify_one();
+			}
+			std::unique_lock<std::mutex> lock(mutex);
+			--running;
+			cond.notify_all();
+		}
+		else
+		{
+			for (;;)
 			{
-				size_t begin1 = clock();
-				for (size_t i = 0; i < ntimes; i++)
+				Batch* batch = nullptr;
 				{
-					v.push_back(ConcurrentAlloc(mem_size));
+					std::unique_lock<std::mutex> lock(mutex);
+					cond.wait(lock, [&]() { return !queue.empty() || running == 0; });
+					if (queue.empty())
+						break;
+					batch = queue.front();
+					queue.pop_front();
 				}
-				size_t end1 = clock();
-				size_t begin2 = clock();
-				for (size_t i = 0; i < ntimes; i++)
+				for (size_t j = 0; j < BATCH; ++j)
 				{
-					ConcurrentFree(v[i]);
+					bool timed = (j % LATENCY_SAMPLE) == 0;
+					size_t begin = timed ? NowNs() : 0;
+					Api::Free(batch->_ptrs[j], batch->_sizes[j]);
+					if (timed)
+						result._latency.push_back((uint32_t)(NowNs() - begin));
 				}
-				size_t end2 = clock();
-				v.clear();
-				malloc_costtime += end1 - begin1;
-				free_costtime += end2 - begin2;
+				result._ops += BATCH;
+				delete batch;
 			}
-		});
-	}
+		}
+	});
+}
 
-	for (size_t k = 0; k < nworks; ++k) vthread[k].join();
+// 长短生命周期混合：少部分对象进入一个很长的环形队列，很久之后才释放，其余的马上释放
+template <class Api>
+static Result BenchMixedLifetime(size_t nthreads, size_t ops, const SizeDist& dist)
+{
+	const size_t LONG_LIVED = 20000; //长生命周期对象的个数
+	const size_t LONG_RATIO = 10; //每多少个对象有一个是长生命周期的
+	const size_t SHORT_LIVED = 64; //短生命周期对象同时存在的个数
+
+	return RunThreads(nthreads, [=](size_t k, ThreadResult& result) {
+		std::mt19937_64 rng(k + 1);
+		std::vector<std::pair<void*, size_t> > longlived(LONG_LIVED, std::make_pair((void*)nullptr, (size_t)0));
+		std::vector<std::pair<void*, size_t> > shortlived(SHORT_LIVED, std::make_pair((void*)nullptr, (size_t)0));
+		size_t longpos = 0, shortpos = 0;
+		result._latency.reserve(ops / LATENCY_SAMPLE + 1);
+
+		for (size_t i = 0; i < ops; ++i)
+		{
+			size_t size = dist.Sample(rng);
+			std::pair<void*, size_t>& slot = (rng() % LONG_RATIO == 0)
+				? longlived[longpos++ % LONG_LIVED]
+				: shortlived[shortpos++ % SHORT_LIVED];
 
-#ifdef SHOWTIME
-	printf("%lu个线程并发执行%lu轮次，每轮次concurrent alloc %lu次: 花费：%lu ms\n", nworks, rounds, ntimes, malloc_costtime);
-	printf("%lu个线程并发执行%lu轮次，每轮次concurrent dealloc %lu次: 花费：%lu ms\n",nworks, rounds, ntimes, free_costtime);
-	printf("%lu个线程并发concurrent alloc&dealloc %lu次，总计花费：%lu ms\n",nworks, nworks*rounds*ntimes, malloc_costtime + free_costtime);
-#endif // SHOWTIME
+			bool timed = (i % LATENCY_SAMPLE) == 0;
+			size_t begin = timed ? NowNs() : 0;
+			if (slot.first != nullptr)
+				Api::Free(slot.first, slot.second);
+			slot.first = Api::Alloc(size);
+			slot.second = size;
+			if (timed)
+				result._latency.push_back((uint32_t)(NowNs() - begin));
+		}
 
-	return std::make_pair(malloc_costtime, free_costtime);
+		for (auto& p : longlived)
+			if (p.first != nullptr)
+				Api::Free(p.first, p.second);
+		for (auto& p : shortlived)
+			if (p.first != nullptr)
+				Api::Free(p.first, p.second);
+		result._ops = ops;
+	});
 }
 
+// 按给定的大小分布申请，保持一个固定大小的工作集
+template <class Api>
+static Result BenchSizeDist(size_t nthreads, size_t ops, const SizeDist& dist)
+{
+	const size_t WORKING_SET = 4096;
+	return RunThreads(nthreads, [=](size_t k, ThreadResult& result) {
+		std::mt19937_64 rng(k + 1);
+		std::vector<std::pair<void*, size_t> > live(WORKING_SET, std::make_pair((void*)nullptr, (size_t)0));
+		result._latency.reserve(ops / LATENCY_SAMPLE + 1);
+
+		for (size_t i = 0; i < ops; ++i)
+		{
+			size_t size = dist.Sample(rng);
+			std::pair<void*, size_t>& slot = live[rng() % WORKING_SET];
+
+			bool timed = (i % LATENCY_SAMPLE) == 0;
+			size_t begin = timed ? NowNs() : 0;
+			if (slot.first != nullptr)
+				Api::Free(slot.first, slot.second);
+			slot.first = Api::Alloc(size);
+			slot.second = size;
+			if (timed)
+				result._latency.push_back((uint32_t)(NowNs() - begin));
+		}
+		for (auto& p : live)
+			if (p.first != nullptr)
+				Api::Free(p.first, p.second);
+		result._ops = ops;
+	});
+}
 
-static void test(int ntimes,int nthreads,int rounds,int mem_size)
+// 节点型容器：std容器走std::allocator(系统malloc)，mystl容器走mystl::allocator
+// 编译时定义了USE_ALLOCTOR_MEM，mystl::allocator的内存来自ConcurrentAlloc
+template <class List, class Map>
+static Result BenchContainers(size_t nthreads, size_t ops)
 {
-	//cout << "==========================================================" << endl;
-	cout << "每次申请内存大小：" << mem_size << "Byte" << endl;
-	std::pair<size_t, size_t> pc = BenchmarkConcurrentMalloc(ntimes, nthreads, rounds, mem_size);
-	std::pair<size_t, size_t> pm = BenchmarkMalloc(ntimes, nthreads, rounds, mem_size);
-	cout << "性能比concurrentalloc/malloc=" << (double)(pm.first + 0.0001) / (double)(pc.first + 0.0001) << endl;//加1防止出现除以0
-	cout << "性能比concurrentdealloc/free=" << (double)(pm.second + 0.0001) / (double)(pc.second + 0.0001) << endl;
-	cout << "总性能比=" << (double)(pm.first + pm.second + 0.0001) / (double)(pc.first + pc.second + 0.0001) << endl;
-	//cout << "==========================================================" << endl;
-	cout << endl;
+	return RunThreads(nthreads, [=](size_t k, ThreadResult& result) {
+		std::mt19937_64 rng(k + 1);
+		List list;
+		Map map;
+		result._latency.reserve(ops / LATENCY_SAMPLE + 1);
+
+		for (size_t i = 0; i < ops; ++i)
+		{
+			bool timed = (i % LATENCY_SAMPLE) == 0;
+			size_t begin = timed ? NowNs() : 0;
+
+			int key = (int)(rng() % 4096);
+			if (i % 2 == 0)
+			{
+				list.push_back(key);
+				if (list.size() > 1024)
+					list.pop_front();
+			}
+			else
+			{
+				auto it = map.find(key);
+				if (it == map.end())
+					map[key] = key;
+				else
+					map.erase(it);
+			}
+
+			if (timed)
+				result._latency.push_back((uint32_t)(NowNs() - begin));
+		}
+		result._ops = ops;
+	});
+}
+
+template <class Api>
+static void RunAll(size_t nthreads, size_t ops, const SizeDist& dist)
+{
+	Print("larson 8-1000", Api::Name(), BenchLarson<Api>(nthreads, ops, 8, 1000));
+	Print("larson 1K-64K", Api::Name(), BenchLarson<Api>(nthreads, ops / 8, 1024, 64 * 1024));
+	Print("producer/consumer", Api::Name(), BenchProducerConsumer<Api>(nthreads, ops, dist));
+	Print("mixed lifetime", Api::Name(), BenchMixedLifetime<Api>(nthreads, ops, dist));
+	Print("size distribution", Api::Name(), BenchSizeDist<Api>(nthreads, ops, dist));
 }
 
-int main()
+int main(int argc, char* argv[])
 {
-	system("clear");
-	int ntimes = 10;//每个线程申请的次数
-	int nthreads = 10;//线程的个数
-	int rounds = 100;//执行的轮次
-	int mem_size = 16 * 1024;
-	size_t arr[] = { 4,16,64,128,512,1024,1024 * 4,1024*8,1024 * 16,1024 * 64,1024 * 128 };
-	for (size_t val : arr)
+	size_t nthreads = std::thread::hardware_concurrency();
+	if (nthreads == 0)
+		nthreads = 4;
+	size_t ops = 1000000;
+	SizeDist dist = SizeDist::Default();
+
+	for (int i = 1; i + 1 < argc; i += 2)
 	{
-		test(ntimes, nthreads, rounds, val);
+		if (strcmp(argv[i], "-t") == 0)
+			nthreads = (size_t)atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-n") == 0)
+			ops = (size_t)atoll(argv[i + 1]);
+		else if (strcmp(argv[i], "-s") == 0 && !dist.Load(argv[i + 1]))
+		{
+			fprintf(stderr, "cannot load size distribution from %s\n", argv[i + 1]);
+			return 1;
+		}
 	}
+	if (nthreads == 0 || ops == 0)
+	{
+		fprintf(stderr, "usage: %s [-t threads] [-n ops per thread] [-s size distribution file]\n", argv[0]);
+		return 1;
+	}
+
+	printf("threads: %zu, ops per thread: %zu\n\n", nthreads, ops);
+	bool cpucache = CpuCache::Enabled();
+	CpuCache::SetEnabled(false);
+	RunAll<PoolApi>(nthreads, ops, dist);
+	printf("\n");
+	CpuCache::SetEnabled(true);
+	RunAll<CpuPoolApi>(nthreads, ops, dist);
+	printf("\n");
+	CpuCache::SetEnabled(cpucache);
+	RunAll<MallocApi>(nthreads, ops, dist);
+	printf("\n");
+
+	Print("list+map", "mystl", BenchContainers<mystl::list<int>, mystl::map<int, int> >(nthreads, ops));
+	Print("list+map", "std", BenchContainers<std::list<int>, std::map<int, int> >(nthreads, ops));
 	return 0;
-}
\ No newline at end of file
+}
@@ -1,33 +1,111 @@
 #include "CentralCache.h"
 #include "PageCache.h"
 
-CentralCache CentralCache::_inst;
+static bool ReadBitmapSpans()
+{
+	const char* env = getenv("CONCURRENT_ALLOC_SPAN_BITMAP");
+	return env != nullptr && strcmp(env, "1") == 0;
+}
+
+std::atomic<bool> CentralCache::_bitmapspans(ReadBitmapSpans());
+
+//位图模式的span切分：前_capacity位置1，不碰对象的内存
+static void CarveBitmap(Span* span)
+{
+	span->_reciprocal = (unsigned int)((((unsigned long long)1 << 32) + span->_objsize - 1) / span->_objsize);
+	for (size_t i = 0; i < SPAN_BITMAP_WORDS; ++i)
+	{
+		size_t first = i << 6;
+		if (first >= span->_capacity)
+			span->_bitmap[i] = 0;
+		else if (span->_capacity - first >= 64)
+			span->_bitmap[i] = ~0ULL;
+		else
+			span->_bitmap[i] = (1ULL << (span->_capacity - first)) - 1;
+	}
+}
+
+//从位图模式的span中取最多n个空闲对象，按地址顺序串起来，span中至少要有一个空闲对象
+static size_t FetchFromBitmap(Span* span, void*& start, void*& end, size_t n)
+{
+	char* base = (char*)(span->_pageid << PAGE_SHIFT);
+	void* prev = nullptr;
+	size_t num = 0;
+	for (size_t i = 0; i < SPAN_BITMAP_WORDS && num < n; ++i)
+	{
+		unsigned long long word = span->_bitmap[i];
+		while (word != 0 && num < n)
+		{
+			void* obj = base + ((i << 6) + CountTrailingZeros(word)) * span->_objsize;
+			word &= word - 1;
+			if (prev == nullptr)
+				start = obj;
+			else
+				NEXT_OBJ(prev) = obj;
+			prev = obj;
+			++num;
+		}
+		span->_bitmap[i] = word;
+	}
+	NEXT_OBJ(prev) = nullptr;
+	end = prev;
+	return num;
+}
+
+//对象在位图模式的span中的序号
+static size_t BitmapIndex(Span* span, void* obj)
+{
+	size_t offset = (char*)obj - (char*)(span->_pageid << PAGE_SHIFT);
+	//offset是_objsize的整数倍并且小于2^32，乘以向上取整的倒数再右移32位正好是序号
+	size_t index = (size_t)(((unsigned long long)offset * span->_reciprocal) >> 32);
+	assert(index < span->_capacity && index * span->_objsize == offset);
+	return index;
+}
+
+//一组对象还给位图模式的span，bits是这些对象的位，只改span的位图
+static void ReleaseToBitmap(Span* span, const unsigned long long* bits)
+{
+	for (size_t i = 0; i < SPAN_BITMAP_WORDS; ++i)
+	{
+		assert((span->_bitmap[i] & bits[i]) == 0); //重复释放
+		span->_bitmap[i] |= bits[i];
+	}
+}
 
 Span* CentralCache::GetOneSpan(SpanList& spanlist, size_t byte_size)
 {
 	Span* span = spanlist.Begin();
 	while (span != spanlist.End())//当前找到一个span
 	{
-		if (span->_list != nullptr)
+		if (span->_usecount < span->_capacity)
 			return span;
 		else
 			span = span->_next;
 	}
 
 	// 走到这儿，说明前面没有获取到span,都是空的，到下一层pagecache获取span
-	Span* newspan = PageCache::GetInstence()->NewSpan(SizeClass::NumMovePage(byte_size));
-	// 将span页切分成需要的对象并链接起来
-	char* cur = (char*)(newspan->_pageid << PAGE_SHIFT);
-	char* end = cur + (newspan->_npage << PAGE_SHIFT);
-	newspan->_list = cur;
+	Span* newspan = PageCache::GetInstence()->NewSpan(SizeClass::ClassNumPage(SizeClass::Index(byte_size)));
 	newspan->_objsize = byte_size;
-	while (cur + byte_size < end)
+	newspan->_capacity = (newspan->_npage << PAGE_SHIFT) / byte_size;
+	newspan->_bitmapmode = BitmapSpans() && newspan->_capacity <= SPAN_BITMAP_WORDS * 64;
+	if (newspan->_bitmapmode)
+	{
+		CarveBitmap(newspan);
+	}
+	else
 	{
-		char* next = cur + byte_size;
-		NEXT_OBJ(cur) = next;
-		cur = next;
+		// 将span页切分成需要的对象并链接起来
+		char* cur = (char*)(newspan->_pageid << PAGE_SHIFT);
+		char* end = cur + (newspan->_npage << PAGE_SHIFT);
+		newspan->_list = cur;
+		while (cur + 2 * byte_size <= end)//保证最后一个对象也完整地落在span内
+		{
+			char* next = cur + byte_size;
+			NEXT_OBJ(cur) = next;
+			cur = next;
+		}
+		NEXT_OBJ(cur) = nullptr;//最后设置为nullptr
 	}
-	NEXT_OBJ(cur) = nullptr;//最后设置为nullptr
 
 	spanlist.PushFront(newspan);
 
@@ -39,10 +117,17 @@ Span* CentralCache::GetOneSpan(SpanList& spanlist, size_t byte_size)
 size_t CentralCache::FetchRangeObj(void*& start, void*& end, size_t n, size_t byte_size)
 {
 	size_t index = SizeClass::Index(byte_size);
+
+	//先看transfer cache里有没有其他线程整批还回来的对象
+	size_t num = _transfer[index].Remove(start, end, n, byte_size);
+	if (num > 0)
+		return num;
+
 	SpanList& spanlist = _spanlist[index];//赋值->拷贝构造
 
 	//记得加锁
-	std::unique_lock<std::mutex> lock(spanlist._mutex);
+	std::unique_lock<std::mutex> lock(spanlist._mutex, std::defer_lock);
+	LockCounted(lock, _waits[index]);
 
 
 	Span* span = GetOneSpan(spanlist, byte_size);
@@ -50,25 +135,32 @@ size_t CentralCache::FetchRangeObj(void*& start, void*& end, size_t n, size_t by
 
 	//从span中获取range对象
 	size_t batchsize = 0;
-	void* prev = nullptr;//提前保存前一个
-	void* cur = span->_list;//用cur来遍历，往后走
-	for (size_t i = 0; i < n; ++i)
+	if (span->_bitmapmode)
 	{
-		prev = cur;
-		cur = NEXT_OBJ(cur);
-		++batchsize;
-		if (cur == nullptr)//随时判断cur是否为空，为空的话，提前停止
-			break;
+		batchsize = FetchFromBitmap(span, start, end, n);
 	}
+	else
+	{
+		void* prev = nullptr;//提前保存前一个
+		void* cur = span->_list;//用cur来遍历，往后走
+		for (size_t i = 0; i < n; ++i)
+		{
+			prev = cur;
+			cur = NEXT_OBJ(cur);
+			++batchsize;
+			if (cur == nullptr)//随时判断cur是否为空，为空的话，提前停止
+				break;
+		}
 
-	start = span->_list;
-	end = prev;
+		start = span->_list;
+		end = prev;
 
-	span->_list = cur;//指向新的内存首地址
+		span->_list = cur;//指向新的内存首地址
+	}
 	span->_usecount += batchsize;
 
 	//将空的span移到最后，保持非空的span在前面
-	if (span->_list == nullptr)
+	if (span->_usecount == span->_capacity)
 	{
 		spanlist.Erase(span);
 		spanlist.PushBack(span);
@@ -77,40 +169,146 @@ size_t CentralCache::FetchRangeObj(void*& start, void*& end, size_t n, size_t by
 	return batchsize;
 }
 
-void CentralCache::ReleaseListToSpans(void* start, size_t size)
+void CentralCache::ReleaseRangeObj(void* start, void* end, size_t n, size_t byte_size)
 {
-	size_t index = SizeClass::Index(size);
-	SpanList& spanlist = _spanlist[index];
+	size_t index = SizeClass::Index(byte_size);
+	if (!_transfer[index].Insert(start, end, n, byte_size))
+	{
+		ReleaseListToSpans(start, byte_size);
+	}
+}
 
-	//将锁放在循环外面
-	// CentralCache:对当前桶进行加锁(桶锁)，减小锁的粒度
-	// PageCache:必须对整个SpanList全局加锁
-	// 因为可能存在多个线程同时去系统申请内存的情况
-	//spanlist.Lock();
-	std::unique_lock<std::mutex> lock(spanlist._mutex);
+void CentralCache::ReleaseTransferCaches(bool idle)
+{
+	for (size_t i = 0; i < NLISTS; ++i)
+	{
+		void* start = nullptr;
+		if (_transfer[i].RemoveAll(start, idle) > 0)
+			ReleaseListToSpans(start, SizeClass::Size(i));
+	}
+}
 
-	while (start)
+void CentralCache::ReleaseListToSpans(void* start, size_t size)
+{
+	//按span把对象分组，每组在锁外串成一个子链表(位图模式的span在锁外记下对象的位，不写对象)，
+	//同一个span的对象通常是挨着还回来的，只有对象落在当前这组的span外面时才查映射，再用span的地址在一个小哈希表里找到它的组
+	//span里还有对象没还回来，它的页号、页数和方式都不会变，锁外读是安全的
+	size_t index = SizeClass::Index(size);
+	SpanGroup groups[RELEASE_GROUPS];
+	unsigned char slots[2 * RELEASE_GROUPS]; //组号+1，0表示空位置
+	memset(slots, 0, sizeof(slots));
+	size_t ngroup = 0, cur = 0;
+	while (start != nullptr)
 	{
 		void* next = NEXT_OBJ(start);
+		if (ngroup == 0 || start < groups[cur]._begin || start >= groups[cur]._end)
+		{
+			Span* span = PageCache::GetInstence()->MapObjectToSpan(start);
+			size_t slot = (size_t)(((unsigned long long)(size_t)span * 0x9E3779B97F4A7C15ULL) >> 40) % (2 * RELEASE_GROUPS);
+			while (slots[slot] != 0 && groups[slots[slot] - 1]._span != span)
+				slot = (slot + 1) % (2 * RELEASE_GROUPS);
 
-		////到时候记得加锁
-		//spanlist.Lock(); // 构成了很多的锁竞争
+			if (slots[slot] == 0)
+			{
+				//组满了先把已有的还回去
+				if (ngroup == RELEASE_GROUPS)
+				{
+					_ReleaseGroups(index, groups, ngroup);
+					ngroup = 0;
+					memset(slots, 0, sizeof(slots));
+					slot = (size_t)(((unsigned long long)(size_t)span * 0x9E3779B97F4A7C15ULL) >> 40) % (2 * RELEASE_GROUPS);
+				}
+				SpanGroup& group = groups[ngroup++];
+				group._span = span;
+				group._begin = (char*)(span->_pageid << PAGE_SHIFT);
+				group._end = group._begin + (span->_npage << PAGE_SHIFT);
+				group._start = nullptr;
+				group._last = start;
+				group._num = 0;
+				if (span->_bitmapmode)
+					memset(group._bits, 0, sizeof(group._bits));
+				slots[slot] = (unsigned char)ngroup;
+			}
+			cur = slots[slot] - 1;
+		}
 
-		Span* span = PageCache::GetInstence()->MapObjectToSpan(start);//获得这个地址开始的内存小单元属于那个span
-		//释放start，也就是将start开始大小为size的小内存单元加入span
-		NEXT_OBJ(start) = span->_list;
-		span->_list = start;
-		//当一个span的对象全部释放回来的时候，将span还给pagecache,并且做页合并
-		if (--span->_usecount == 0)//更新_usecount
+		SpanGroup& group = groups[cur];
+		if (group._span->_bitmapmode)
 		{
-			spanlist.Erase(span);
-			PageCache::GetInstence()->ReleaseSpanToPageCache(span);
+			size_t bit = BitmapIndex(group._span, start);
+			assert((group._bits[bit >> 6] & (1ULL << (bit & 63))) == 0); //重复释放
+			group._bits[bit >> 6] |= 1ULL << (bit & 63);
 		}
+		else
+		{
+			NEXT_OBJ(start) = group._start;
+			group._start = start;
+		}
+		++group._num;
+		start = next;
+	}
 
-		//spanlist.Unlock();
+	if (ngroup > 0)
+		_ReleaseGroups(index, groups, ngroup);
+}
 
-		start = next;
+void CentralCache::_ReleaseGroups(size_t index, SpanGroup* groups, size_t ngroup)
+{
+	// CentralCache:对当前桶进行加锁(桶锁)，减小锁的粒度
+	//全部还回来的span先记下来，放掉桶锁之后再一起还给PageCache
+	Span* freespans[RELEASE_GROUPS];
+	size_t nfree = 0;
+	{
+		SpanList& spanlist = _spanlist[index];
+		std::unique_lock<std::mutex> lock(spanlist._mutex, std::defer_lock);
+		LockCounted(lock, _waits[index]);
+		for (size_t g = 0; g < ngroup; ++g)
+		{
+			SpanGroup& group = groups[g];
+			Span* span = group._span;
+			if (span->_bitmapmode)
+			{
+				ReleaseToBitmap(span, group._bits);
+			}
+			else
+			{
+				NEXT_OBJ(group._last) = span->_list;
+				span->_list = group._start;
+			}
+
+			span->_usecount -= group._num;
+			if (span->_usecount == 0)
+			{
+				spanlist.Erase(span);
+				freespans[nfree++] = span;
+			}
+		}
 	}
 
-	//spanlist.Unlock();
-}
\ No newline at end of file
+	//当一个span的对象全部释放回来的时候，将span还给pagecache,并且做页合并
+	if (nfree > 0)
+		PageCache::GetInstence()->ReleaseSpansToPageCache(freespans, nfree);
+}
+
+void CentralCache::GetClassStats(size_t index, SizeClassStats& stats)
+{
+	size_t size = SizeClass::Size(index);
+	SpanList& spanlist = _spanlist[index];
+	stats._spans = 0;
+	stats._centralfree = 0;
+	stats._wastebytes = 0;
+	{
+		std::unique_lock<std::mutex> lock(spanlist._mutex);
+		for (Span* span = spanlist.Begin(); span != spanlist.End(); span = span->_next)
+		{
+			//span切出的对象个数减去分出去的就是空闲的
+			size_t bytes = span->_npage << PAGE_SHIFT;
+			++stats._spans;
+			stats._centralfree += span->_capacity - span->_usecount;
+			stats._wastebytes += bytes % size;
+		}
+	}
+	stats._transfercached = _transfer[index].Count();
+	stats._lockwaits = _waits[index].Get();
+	stats._transferwaits = _transfer[index].Waits();
+}
@@ -1,6 +1,10 @@
 #pragma once
 
 #include "Common.h"
+#include "TransferCache.h"
+#include "Stats.h"
+
+const size_t RELEASE_GROUPS = 64; //ReleaseListToSpans一次最多同时处理多少个span
 
 //上面的ThreadCache里面没有的话，要从中心获取
 
@@ -18,7 +22,11 @@ class CentralCache
 public:
 	static CentralCache* Getinstence()
 	{
-		return &_inst;
+		//第一次使用时在静态存储上构造，并且永远不析构，
+		//替换系统malloc后可能在静态对象构造之前或者析构之后被调用
+		static std::aligned_storage<sizeof(CentralCache), alignof(CentralCache)>::type storage;
+		static CentralCache* inst = new(&storage) CentralCache;
+		return inst;
 	}
 
 	//从page cache获取一个span
@@ -28,14 +36,56 @@ public:
 	size_t FetchRangeObj(void*& start, void*& end, size_t n, size_t byte_size);
 
 	//将一定数量的对象释放给span跨度
+	//对象先按span分组，每个span只更新一次，全部还回来的span放掉桶锁之后再还给PageCache
 	void ReleaseListToSpans(void* start, size_t size);
 
+	//ThreadCache还回来一整批对象，优先放进transfer cache，放不下再还给span
+	void ReleaseRangeObj(void* start, void* end, size_t n, size_t byte_size);
+
+	//把transfer cache里的对象还给span，idle为true时只还上次调用之后没有用过的大小
+	void ReleaseTransferCaches(bool idle);
+
+	//填写index位置的span个数、空闲对象个数和锁竞争次数
+	void GetClassStats(size_t index, SizeClassStats& stats);
+
+	//新切的span是否用位图记录空闲对象，设置环境变量CONCURRENT_ALLOC_SPAN_BITMAP=1打开
+	//切span时不用把所有对象串起来，整批还回来的对象在锁外按span记下位，只读它们的链表指针，不写对象
+	//取对象时仍然要把取出的对象串成链表交给ThreadCache
+	//只影响之后切的span，已经切好的span保持原来的方式
+	static bool BitmapSpans()
+	{
+		return _bitmapspans.load(std::memory_order_relaxed);
+	}
+	static void SetBitmapSpans(bool enabled)
+	{
+		_bitmapspans.store(enabled, std::memory_order_relaxed);
+	}
+
 private:
 	SpanList _spanlist[NLISTS];
+	TransferCache _transfer[NLISTS];
+	StatCounter _waits[NLISTS]; //每个桶锁的竞争次数
+
+	static std::atomic<bool> _bitmapspans;
 
 private:
+	//ReleaseListToSpans中属于同一个span的一组对象，已经串成以_start开头、_last结尾的链表，
+	//位图模式的span不串链表，对象的位记在_bits里
+	struct SpanGroup
+	{
+		Span* _span;
+		char* _begin; //span的地址范围
+		char* _end;
+		void* _start;
+		void* _last;
+		size_t _num;
+		unsigned long long _bits[SPAN_BITMAP_WORDS];
+	};
+
+	//在桶锁下把每组对象一次接到它的span上，全部还回来的span放掉桶锁之后还给PageCache
+	void _ReleaseGroups(size_t index, SpanGroup* groups, size_t ngroup);
+
 	CentralCache(){}//声明不实现，防止默认构造，自己创建
 
 	CentralCache(CentralCache&) = delete;
-	static CentralCache _inst;
 };
\ No newline at end of file
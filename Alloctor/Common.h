@@ -6,8 +6,12 @@
 #include <unordered_map>
 #include <vector>
 #include <stdlib.h>
+#include <string.h>
 #include <algorithm>
 #include <assert.h>
+#include <atomic>
+#include <new>
+#include <type_traits>
 
 using std::cout;
 using std::endl;
@@ -15,14 +19,39 @@ using std::endl;
 #ifdef _WIN32
 #include <Windows.h>
 #else
-	
+#include <sys/mman.h>
+#include <sched.h>
 #endif
 
 const size_t MAX_BYTES = 64 * 1024; //ThreadCache 申请的最大内存
 const size_t NLISTS = 184; //数组元素总的有多少个，由对齐规则计算得来
 const size_t PAGE_SHIFT = 12;
 const size_t NPAGES = 129;
+const size_t NSHARDS = 8; //PageCache分片数，每个分片有自己的锁和地址区域
 
+// 直接向系统按页申请内存，不经过malloc，用于分配器自身的元数据
+inline static void* SystemAlloc(size_t npage)
+{
+#ifdef _WIN32
+	void* ptr = VirtualAlloc(0, npage << PAGE_SHIFT, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+	void* ptr = mmap(nullptr, npage << PAGE_SHIFT, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED)
+		ptr = nullptr;
+#endif
+	return ptr;
+}
+
+// 当前线程所在的CPU编号，取不到时返回0
+inline static size_t CurrentCpu()
+{
+#ifdef _WIN32
+	return GetCurrentProcessorNumber();
+#else
+	int cpu = sched_getcpu();
+	return cpu < 0 ? 0 : (size_t)cpu;
+#endif
+}
 
 inline static void*& NEXT_OBJ(void* obj)//抢取对象头四个或者头八个字节，void*的别名，本省是内存，只能我们自己取
 {
@@ -30,19 +59,61 @@ inline static void*& NEXT_OBJ(void* obj)//抢取对象头四个或者头八个
 	return *((void**)obj);   // 先强转为void**,然后解引用就是一个void*
 }
 
+//最低的1所在的位置，x不能是0
+inline static size_t CountTrailingZeros(unsigned long long x)
+{
+	assert(x != 0);
+#ifdef _WIN32
+	unsigned long index;
+	_BitScanForward64(&index, x);
+	return index;
+#else
+	return (size_t)__builtin_ctzll(x);
+#endif
+}
+
+//自旋锁，用于只有几条语句的临界区
+class SpinLock
+{
+private:
+	std::atomic_flag _flag = ATOMIC_FLAG_INIT;
+
+public:
+	void Lock()
+	{
+		while (_flag.test_and_set(std::memory_order_acquire))
+			std::this_thread::yield();
+	}
+
+	bool TryLock()
+	{
+		return !_flag.test_and_set(std::memory_order_acquire);
+	}
+
+	void Unlock()
+	{
+		_flag.clear(std::memory_order_release);
+	}
+};
+
 //设置一个公共的FreeList对象链表，每个对象中含有各个接口，到时候直接使用接口进行操作
 //让一个类来管理自由链表
 class Freelist
 {
 private:
 	void* _list = nullptr; // 给上缺省值
+	void* _tail = nullptr; // 最后一个对象，整批还给中心缓存时不用再遍历
 	size_t _size = 0;  // 记录有多少个对象
 	size_t _maxsize = 1;
+	size_t _lowwater = 0; // 上次回收以来链表最短时的长度，这么多对象一直没有用到
+	size_t _overages = 0; // 链表超过_maxsize的次数，多次超过说明_maxsize太大了
 
 public:
 
 	void Push(void* obj)
 	{
+		if (_list == nullptr)
+			_tail = obj;
 		NEXT_OBJ(obj) = _list;
 		_list = obj;
 		++_size;
@@ -50,6 +121,8 @@ public:
 
 	void PushRange(void* start, void* end, size_t n)
 	{
+		if (_list == nullptr)
+			_tail = end;
 		NEXT_OBJ(end) = _list;
 		_list = start;
 		_size += n;
@@ -60,18 +133,65 @@ public:
 		void* obj = _list;
 		_list = NEXT_OBJ(obj);
 		--_size;
+		if (_size < _lowwater)
+			_lowwater = _size;
 
 		return obj;
 	}
 
+	//最多取出n个对象放进数组，返回实际取出的个数
+	size_t PopBatch(void** out, size_t n)
+	{
+		size_t i = 0;
+		for (; i < n && _list != nullptr; ++i)
+		{
+			out[i] = _list;
+			_list = NEXT_OBJ(_list);
+		}
+		_size -= i;
+		if (_size < _lowwater)
+			_lowwater = _size;
+
+		return i;
+	}
+
+	//从头部取出n个对象(n不超过Size())，给出第一个和最后一个
+	void PopRange(void*& start, void*& end, size_t n)
+	{
+		assert(n > 0 && n <= _size);
+		start = _list;
+		end = _list;
+		for (size_t i = 1; i < n; ++i)
+			end = NEXT_OBJ(end);
+		_list = NEXT_OBJ(end);
+		NEXT_OBJ(end) = nullptr;
+		_size -= n;
+		if (_size < _lowwater)
+			_lowwater = _size;
+	}
+
 	void* PopRange()
 	{
 		_size = 0;
+		_lowwater = 0;
 		void* list = _list;
 		_list = nullptr;
 
 		return list;
 	}
+
+	//取出全部对象，同时给出最后一个对象和个数
+	size_t PopRange(void*& start, void*& end)
+	{
+		size_t n = _size;
+		start = _list;
+		end = _tail;
+		_size = 0;
+		_lowwater = 0;
+		_list = nullptr;
+
+		return n;
+	}
 	
 	bool Empty()
 	{
@@ -93,11 +213,211 @@ public:
 	{
 		_maxsize = maxsize;
 	}
+
+	size_t LowWater()
+	{
+		return _lowwater;
+	}
+
+	void ClearLowWater()
+	{
+		_lowwater = _size;
+	}
+
+	size_t Overages()
+	{
+		return _overages;
+	}
+
+	void SetOverages(size_t overages)
+	{
+		_overages = overages;
+	}
+};
+
+//编译期生成大小到自由链表位置的查找表(C++11没有std::index_sequence，自己实现一个)
+template <size_t... I>
+struct IndexList {};
+
+template <class A, class B>
+struct ConcatIndex;
+
+template <size_t... I, size_t... J>
+struct ConcatIndex<IndexList<I...>, IndexList<J...> >
+{
+	typedef IndexList<I..., (sizeof...(I) + J)...> type;
+};
+
+//对半拆分，模板实例化的深度只有log(N)
+template <size_t N>
+struct MakeIndexList
+{
+	typedef typename ConcatIndex<typename MakeIndexList<N / 2>::type,
+		typename MakeIndexList<N - N / 2>::type>::type type;
 };
 
+template <>
+struct MakeIndexList<0>
+{
+	typedef IndexList<> type;
+};
+
+template <>
+struct MakeIndexList<1>
+{
+	typedef IndexList<0> type;
+};
+
+// 控制在12%左右的内碎片浪费
+// [1,128]				8byte对齐 freelist[0,16)
+// [129,1024]			16byte对齐 freelist[16,72)
+// [1025,8*1024]		128byte对齐 freelist[72,128)
+// [8*1024+1,64*1024]	1024byte对齐 freelist[128,184)
+//
+// 所有查找表都从ClassSize生成，换一组对象大小只需要改这里
+// 1024以内的对象大小必须是8的倍数，1024以上的必须是128的倍数，查找表按这个粒度索引
+//
+// 也可以用Tuner按实际的大小分布生成一组对象大小，编译时定义
+// CONCURRENT_ALLOC_SIZE_CLASSES="生成的头文件"，头文件里的TUNED_CLASS_SIZES代替上面的规则
+#ifdef CONCURRENT_ALLOC_SIZE_CLASSES
+#include CONCURRENT_ALLOC_SIZE_CLASSES
+static_assert(sizeof(TUNED_CLASS_SIZES) / sizeof(TUNED_CLASS_SIZES[0]) == NLISTS, "a tuned table must have NLISTS classes");
+
+//替换系统malloc时申请的大小先按16取整，16以上的对象大小都是16的倍数，切出来的对象才是16字节对齐的
+constexpr bool TunedClassesAligned(size_t index = 0)
+{
+	return index == NLISTS ? true
+		: (TUNED_CLASS_SIZES[index] > 16 && TUNED_CLASS_SIZES[index] % 16 != 0) ? false
+		: TunedClassesAligned(index + 1);
+}
+static_assert(TunedClassesAligned(), "tuned size classes above 16 bytes must be multiples of 16");
+#endif
+
+struct SizeClassGen
+{
+	//第index个自由链表的对象大小
+	static constexpr size_t ClassSize(size_t index)
+	{
+#ifdef CONCURRENT_ALLOC_SIZE_CLASSES
+		return TUNED_CLASS_SIZES[index];
+#else
+		return index < 16 ? (index + 1) << 3
+			: index < 72 ? 128 + ((index - 16 + 1) << 4)
+			: index < 128 ? 1024 + ((index - 72 + 1) << 7)
+			: 8 * 1024 + ((index - 128 + 1) << 10);
+#endif
+	}
+
+	//从index开始的对象大小是否递增，并且符合查找表的粒度
+	static constexpr bool Valid(size_t index = 0)
+	{
+		return index == NLISTS ? true
+			: (index > 0 && ClassSize(index) <= ClassSize(index - 1)) ? false
+			: ClassSize(index) % (ClassSize(index) <= 1024 ? 8 : 128) != 0 ? false
+			: Valid(index + 1);
+	}
+
+	//能放下size字节的最小的自由链表
+	static constexpr size_t ClassOf(size_t size, size_t index = 0)
+	{
+		return (index + 1 >= NLISTS || ClassSize(index) >= size) ? index : ClassOf(size, index + 1);
+	}
+
+	//从中心缓存一次取多少个size字节的对象到ThreadCache
+	static constexpr size_t NumMoveSize(size_t size)
+	{
+		return size == 0 ? 0
+			: MAX_BYTES / size < 2 ? 2
+			: MAX_BYTES / size > 512 ? 512
+			: MAX_BYTES / size;
+	}
+
+	//中心缓存一次向页缓存要多少页的span
+	static constexpr size_t NumMovePage(size_t size)
+	{
+		return ((NumMoveSize(size) * size) >> PAGE_SHIFT) == 0 ? 1 : (NumMoveSize(size) * size) >> PAGE_SHIFT;
+	}
+};
+
+static_assert(SizeClassGen::ClassSize(NLISTS - 1) == MAX_BYTES, "the last size class must be MAX_BYTES");
+static_assert(SizeClassGen::Valid(), "size classes must increase and match the lookup table granularity");
+
+//按大小查表的结果，一次访存就能拿到自由链表的位置、对齐后的大小和一次搬运的个数
+struct SizeInfo
+{
+	unsigned short _index;
+	unsigned short _nummove;
+	unsigned int _size;
+};
+
+//每个自由链表的参数
+struct ClassInfo
+{
+	unsigned int _size;
+	unsigned short _nummove;
+	unsigned short _numpage;
+};
+
+constexpr SizeInfo MakeSizeInfo(size_t size)
+{
+	return SizeInfo{ (unsigned short)SizeClassGen::ClassOf(size),
+		(unsigned short)SizeClassGen::NumMoveSize(SizeClassGen::ClassSize(SizeClassGen::ClassOf(size))),
+		(unsigned int)SizeClassGen::ClassSize(SizeClassGen::ClassOf(size)) };
+}
+
+constexpr ClassInfo MakeClassInfo(size_t index)
+{
+	return ClassInfo{ (unsigned int)SizeClassGen::ClassSize(index),
+		(unsigned short)SizeClassGen::NumMoveSize(SizeClassGen::ClassSize(index)),
+		(unsigned short)SizeClassGen::NumMovePage(SizeClassGen::ClassSize(index)) };
+}
+
+//[0,1024]按8字节一格，下标是(size+7)>>3
+template <class List>
+struct SmallSizeTable;
+
+template <size_t... I>
+struct SmallSizeTable<IndexList<I...> >
+{
+	static constexpr SizeInfo _table[sizeof...(I)] = { MakeSizeInfo(I << 3)... };
+};
+
+template <size_t... I>
+constexpr SizeInfo SmallSizeTable<IndexList<I...> >::_table[sizeof...(I)];
+
+//(1024,64K]按128字节一格，下标是(size+127)>>7
+template <class List>
+struct LargeSizeTable;
+
+template <size_t... I>
+struct LargeSizeTable<IndexList<I...> >
+{
+	static constexpr SizeInfo _table[sizeof...(I)] = { MakeSizeInfo(I << 7)... };
+};
+
+template <size_t... I>
+constexpr SizeInfo LargeSizeTable<IndexList<I...> >::_table[sizeof...(I)];
+
+template <class List>
+struct ClassInfoTable;
+
+template <size_t... I>
+struct ClassInfoTable<IndexList<I...> >
+{
+	static constexpr ClassInfo _table[sizeof...(I)] = { MakeClassInfo(I)... };
+};
+
+template <size_t... I>
+constexpr ClassInfo ClassInfoTable<IndexList<I...> >::_table[sizeof...(I)];
+
 //专门用来计算大小位置的类
 class SizeClass
 {
+private:
+	typedef SmallSizeTable<MakeIndexList<(1024 >> 3) + 1>::type> SmallTable;
+	typedef LargeSizeTable<MakeIndexList<(MAX_BYTES >> 7) + 1>::type> LargeTable;
+	typedef ClassInfoTable<MakeIndexList<NLISTS>::type> ClassTable;
+
 public:
 	//获取Freelist的位置
 	inline static size_t _Index(size_t size, size_t align)
@@ -113,56 +433,31 @@ public:
 	}
 
 public:
-	// 控制在12%左右的内碎片浪费
-	// [1,128]				8byte对齐 freelist[0,16)
-	// [129,1024]			16byte对齐 freelist[16,72)
-	// [1025,8*1024]		128byte对齐 freelist[72,128)
-	// [8*1024+1,64*1024]	1024byte对齐 freelist[128,184)
+	//查表代替原来按区间的分支和移位
+	inline static const SizeInfo& Lookup(size_t size)
+	{
+		assert(size <= MAX_BYTES);
+		return size <= 1024 ? SmallTable::_table[(size + 7) >> 3] : LargeTable::_table[(size + 127) >> 7];
+	}
 
 	inline static size_t Index(size_t size)
 	{
-		assert(size <= MAX_BYTES);
+		return Lookup(size)._index;
+	}
 
-		// 每个区间有多少个链
-		static int group_array[4] = { 16, 56, 56, 56 };
-		if (size <= 128)
-		{
-			return _Index(size, 3);
-		}
-		else if (size <= 1024)
-		{
-			return _Index(size - 128, 4) + group_array[0];
-		}
-		else if (size <= 8192)
-		{
-			return _Index(size - 1024, 7) + group_array[0] + group_array[1];
-		}
-		else//if (size <= 65536)
-		{
-			return _Index(size - 8 * 1024, 10) + group_array[0] + group_array[1] + group_array[2];
-		}
+	// 根据自由链表的位置反推对象大小，Index的逆运算
+	inline static size_t Size(size_t index)
+	{
+		assert(index < NLISTS);
+		return ClassTable::_table[index]._size;
 	}
 
 	// 对齐大小计算，向上取整
 	static inline size_t Roundup(size_t bytes)
 	{
-		assert(bytes <= MAX_BYTES);
-
-		if (bytes <= 128){
-			return _Roundup(bytes, 3);
-		}
-		else if (bytes <= 1024){
-			return _Roundup(bytes, 4);
-		}
-		else if (bytes <= 8192){
-			return _Roundup(bytes, 7);
-		}
-		else {//if (bytes <= 65536){
-			return _Roundup(bytes, 10);
-		}
+		return Lookup(bytes)._size;
 	}
 
-
 	/* 关于动态计算
 	size		NumMoveSize		NumMovePage
 	4       	512     		1
@@ -182,31 +477,38 @@ public:
 	//动态计算从中心缓存分配多少个size字节大小的内存到ThreadCache中
 	static size_t NumMoveSize(size_t size)
 	{
-		if (size == 0)
-			return 0;
-
-		int num = (int)(MAX_BYTES / size);
-		if (num < 2)
-			num = 2;
-
-		if (num > 512)
-			num = 512;
-
-		return num;
+		return SizeClassGen::NumMoveSize(size);
 	}
 
 	// 根据size计算中心缓存要从页缓存获取多大的span对象
 	static size_t NumMovePage(size_t size)
 	{
-		size_t num = NumMoveSize(size);
-		size_t npage = num*size;
-		npage >>= PAGE_SHIFT;
-		if (npage == 0)
-			npage = 1;
-		return npage;
+		return SizeClassGen::NumMovePage(size);
+	}
+
+	//每个自由链表预先算好的值，热路径上不用再做除法
+	static size_t ClassNumMove(size_t index)
+	{
+		assert(index < NLISTS);
+		return ClassTable::_table[index]._nummove;
+	}
+
+	static size_t ClassNumPage(size_t index)
+	{
+		assert(index < NLISTS);
+		return ClassTable::_table[index]._numpage;
 	}
 };
 
+//编译期已知大小时的自由链表位置和对齐后的大小，和SizeClass::Index/Roundup的结果一致
+template <size_t Size>
+struct SizeClassOf
+{
+	static_assert(Size <= MAX_BYTES, "only small objects have a size class");
+	static constexpr size_t index = SizeClassGen::ClassOf(Size);
+	static constexpr size_t size = SizeClassGen::ClassSize(index);
+};
+
 #ifdef _WIN32
 	typedef size_t PageID;
 #else
@@ -215,6 +517,8 @@ public:
 
 //Span是一个跨度，既可以分配内存出去，也是负责将内存回收回来到PageCache合并
 //是一链式结构，定义为结构体就行，避免需要很多的友元
+const size_t SPAN_BITMAP_WORDS = 8; //位图模式的span最多512个对象，现在所有大小的span都不超过这个数
+
 struct Span
 {
 	PageID _pageid = 0;//页号
@@ -227,6 +531,18 @@ struct Span
 	size_t _objsize = 0;//对象的大小
 
 	size_t _usecount = 0;//对象使用计数,
+	size_t _capacity = 0;//切出的对象个数，_usecount等于它时span里没有空闲对象
+
+	//位图模式：空闲对象不串成_list，而是在_bitmap中每个对象占一位，1表示空闲
+	//切span时只需要置位，还回来的对象(包括ReleaseListToSpans分组时)也不用写它的内存
+	bool _bitmapmode = false;
+	unsigned int _reciprocal = 0;//ceil(2^32/_objsize)，用乘法代替除法算出对象的序号
+	unsigned long long _bitmap[SPAN_BITMAP_WORDS];
+
+	bool _isuse = false;//是否已经从PageCache分配出去，合并时只看这个标记
+	bool _released = false;//空闲时页是否已经还给了系统(页号映射仍然保留)
+	size_t _freetime = 0;//回到PageCache空闲链表的时间(毫秒)
+	size_t _shard = 0;//所属的PageCache分片，创建后不再改变
 };
 
 //和上面的Freelist一样，各个接口自己实现，双向带头循环的Span链表
@@ -236,26 +552,18 @@ public:
 	Span* _head;
 	std::mutex _mutex;
 
+private:
+	Span _headspan; //头结点直接放在对象里，不需要向系统申请
+
 public:
 	SpanList()
 	{
-		_head = new Span;
+		_head = &_headspan;
 		_head->_next = _head;
 		_head->_prev = _head;
 	}
 
-	~SpanList()//释放链表的每个节点
-	{
-		Span * cur = _head->_next;
-		while (cur != _head)
-		{
-			Span* next = cur->_next;
-			delete cur;
-			cur = next;
-		}
-		delete _head;
-		_head = nullptr;
-	}
+	//链表中的span都属于PageCache的对象池，这里不释放
 
 	//防止拷贝构造和赋值构造，将其封死，没有拷贝的必要，不然就自己会实现浅拷贝
 	SpanList(const SpanList&) = delete;
@@ -2,7 +2,77 @@
 
 #include "Common.h"
 #include "ThreadCache.h"
+#include "CentralCache.h"
 #include "PageCache.h"
+#include "CpuCache.h"
+#include "Stats.h"
+#include "HeapProfiler.h"
+#include "TraceRecorder.h"
+
+//小对象的申请，按照选择的前端交给ThreadCache或者CpuCache
+static inline void* _SmallAlloc(size_t size)
+{
+	if (CpuCache::Enabled())
+		return CpuCache::GetInstence()->Allocate(size);
+
+	//变量tlslist用来申请工具
+	ThreadCache* cache = tlslist;
+	if (cache == nullptr)//第一次来，自己创建，后面来的，就可以直接使用当前创建好的内存池
+	{
+		cache = CreateThreadCache();
+		if (cache == nullptr)//线程正在退出，ThreadCache已经销毁，直接从中心缓存拿一个
+		{
+			void* start = nullptr, *end = nullptr;
+			CentralCache::Getinstence()->FetchRangeObj(start, end, 1, SizeClass::Roundup(size));
+			return start;
+		}
+	}
+	return cache->Allocate(size);
+}
+
+//自由链表的位置已经算好的版本，只有ThreadCache前端能省掉查表，其他情况走普通路径
+static inline void* _SmallAllocIndex(size_t index, size_t size)
+{
+	ThreadCache* cache = tlslist;
+	if (cache != nullptr && !CpuCache::Enabled())
+		return cache->AllocateIndex(index, size);
+	return _SmallAlloc(size);
+}
+
+//小对象的释放
+//释放的线程不一定是申请的线程，对象放进释放线程自己的ThreadCache，
+//链表过长时再批量还给中心缓存，供其他线程使用
+static inline void _SmallFree(void* ptr, size_t size)
+{
+	if (CpuCache::Enabled())
+	{
+		CpuCache::GetInstence()->Deallocate(ptr, size);
+		return;
+	}
+
+	ThreadCache* cache = tlslist;
+	if (cache == nullptr)
+		cache = CreateThreadCache();
+
+	if (cache != nullptr)
+	{
+		cache->Deallocate(ptr, size);
+	}
+	else//线程正在退出，ThreadCache已经销毁，直接还给中心缓存
+	{
+		NEXT_OBJ(ptr) = nullptr;
+		CentralCache::Getinstence()->ReleaseListToSpans(ptr, size);
+	}
+}
+
+static inline void _SmallFreeIndex(void* ptr, size_t index, size_t size)
+{
+	ThreadCache* cache = tlslist;
+	if (cache != nullptr && !CpuCache::Enabled())
+		cache->DeallocateIndex(ptr, index, size);
+	else
+		_SmallFree(ptr, size);
+}
 
 //被动调用，哪个线程来了之后，需要内存就调用这个接口
 static inline void* ConcurrentAlloc(size_t size)
@@ -12,16 +82,16 @@ static inline void* ConcurrentAlloc(size_t size)
 		//return malloc(size);
 		Span* span = PageCache::GetInstence()->AllocBigPageObj(size);
 		void* ptr = (void*)(span->_pageid << PAGE_SHIFT);
+		SampleAlloc(ptr, size);
+		TraceAlloc(ptr, size);
 		return ptr;
 	}
 	else
 	{
-		//变量tlslist用来申请工具
-		if (tlslist == nullptr)//第一次来，自己创建，后面来的，就可以直接使用当前创建好的内存池
-		{
-			tlslist = new ThreadCache;
-		}
-		return tlslist->Allocate(size);
+		void* ptr = _SmallAlloc(size);
+		SampleAlloc(ptr, size);
+		TraceAlloc(ptr, size);
+		return ptr;
 	}
 }
 
@@ -34,10 +104,222 @@ static inline void ConcurrentFree(void* ptr)//最后释放
 	if (size > MAX_BYTES)
 	{
 		//free(ptr);
+		//ptr可能是按大于一页对齐后的内部指针，采样记录的是span的起始地址
+		SampleFree((void*)(span->_pageid << PAGE_SHIFT));
+		TraceFree((void*)(span->_pageid << PAGE_SHIFT));
 		PageCache::GetInstence()->FreeBigPageObj(ptr, span);
 	}
 	else
 	{
-		tlslist->Deallocate(ptr, size);
+		SampleFree(ptr);
+		TraceFree(ptr);
+		_SmallFree(ptr, size);
+	}
+}
+
+//带大小的释放，size必须是申请时传入的大小
+//小对象直接由size算出自由链表的位置，省掉一次页号到span的查找
+static inline void ConcurrentFree(void* ptr, size_t size)
+{
+	if (size == 0 || size > MAX_BYTES)//大对象还是要通过span才知道是哪种方式分配的
+	{
+		ConcurrentFree(ptr);
+		return;
+	}
+
+	SampleFree(ptr);
+	TraceFree(ptr);
+	_SmallFree(ptr, size);
+}
+
+//按align对齐申请size字节，align必须是2的幂，申请失败抛出std::bad_alloc
+//不超过一页时，把大小按align取整，对应的自由链表对象大小也是align的倍数，
+//而span按页对齐，所以切出来的每个对象都满足对齐；超过一页时按大对象多申请align再调整
+static inline void* ConcurrentAllocAligned(size_t size, size_t align)
+{
+	assert(align != 0 && (align & (align - 1)) == 0);
+	if (align <= sizeof(void*))
+		return ConcurrentAlloc(size);
+
+	//Tuner生成的对象大小不一定是align的倍数，这时按大对象处理
+	size_t rounded = (size + align - 1) & ~(align - 1);
+	if (align <= ((size_t)1 << PAGE_SHIFT)
+		&& (rounded == 0 || rounded > MAX_BYTES || SizeClass::Roundup(rounded) % align == 0))
+		return ConcurrentAlloc(rounded);
+
+	size_t bytes = size + align;
+	if (bytes <= MAX_BYTES)
+		bytes = MAX_BYTES + 1;
+	char* ptr = (char*)ConcurrentAlloc(bytes);
+	//返回的是大对象span的内部指针，ConcurrentFree按span释放
+	return (void*)(((size_t)ptr + align - 1) & ~(align - 1));
+}
+
+//ptr处实际可用的字节数：小对象是整个自由链表对象，大对象是span中ptr之后的部分
+//申请时的大小被对齐取整了，多出来的部分可以直接使用
+static inline size_t ConcurrentUsableSize(void* ptr)
+{
+	Span* span = PageCache::GetInstence()->MapObjectToSpan(ptr);
+	if (span->_objsize <= MAX_BYTES)
+		return span->_objsize;
+	char* start = (char*)(span->_pageid << PAGE_SHIFT);
+	return span->_objsize - ((char*)ptr - start);
+}
+
+//把ptr处的对象改成size字节，内容保留到两者中较小的大小，返回新的地址，申请失败抛出std::bad_alloc
+//ptr为空时相当于ConcurrentAlloc；size为0时释放ptr并返回nullptr
+//原来的对象够用并且不会浪费一半以上时直接原地返回；大对象先尝试原地扩展，都不行再申请新的并拷贝
+static inline void* ConcurrentRealloc(void* ptr, size_t size)
+{
+	if (ptr == nullptr)
+		return ConcurrentAlloc(size);
+	if (size == 0)
+	{
+		ConcurrentFree(ptr);
+		return nullptr;
 	}
-}
\ No newline at end of file
+
+	Span* span = PageCache::GetInstence()->MapObjectToSpan(ptr);
+	size_t old = ConcurrentUsableSize(ptr);
+	if (size <= old && size >= old / 2)
+	{
+		//地址不变，但对采样和trace来说大小变了，和原地扩展一样记成释放再申请
+		//大对象的记录用span的起始地址
+		void* key = span->_objsize > MAX_BYTES ? (void*)(span->_pageid << PAGE_SHIFT) : ptr;
+		size_t recorded = (char*)ptr - (char*)key + size;
+		SampleFree(key);
+		TraceFree(key);
+		SampleAlloc(key, recorded);
+		TraceAlloc(key, recorded);
+		return ptr;
+	}
+
+	if (span->_objsize > MAX_BYTES && size > MAX_BYTES)
+	{
+		//ptr可能是按大于一页对齐后的内部指针，span要覆盖到ptr之后的size字节
+		char* start = (char*)(span->_pageid << PAGE_SHIFT);
+		size_t offset = (char*)ptr - start;
+		if (PageCache::GetInstence()->ResizeBigPageObj(span, offset + size))
+		{
+			//对采样和trace来说相当于释放了原来的对象，又申请了一个新的
+			SampleFree(start);
+			TraceFree(start);
+			start = (char*)(span->_pageid << PAGE_SHIFT);
+			SampleAlloc(start, offset + size);
+			TraceAlloc(start, offset + size);
+			return start + offset;
+		}
+	}
+
+	void* newptr = ConcurrentAlloc(size);
+	memcpy(newptr, ptr, old < size ? old : size);
+	ConcurrentFree(ptr);
+	return newptr;
+}
+
+//一次申请n个size大小的对象放进out，申请失败抛出std::bad_alloc
+//小对象整段从ThreadCache的自由链表取，不够的部分一次向中心缓存要，不用每个对象单独走一遍
+static inline void ConcurrentAllocBatch(size_t size, size_t n, void** out)
+{
+	ThreadCache* cache = tlslist;
+	if (cache == nullptr && size <= MAX_BYTES && !CpuCache::Enabled())
+		cache = CreateThreadCache();
+
+	if (size > MAX_BYTES || CpuCache::Enabled() || cache == nullptr)
+	{
+		size_t i = 0;
+		try
+		{
+			for (; i < n; ++i)
+				out[i] = ConcurrentAlloc(size);
+		}
+		catch (...)
+		{
+			//已经申请到的释放掉，失败时什么都不留下
+			for (size_t j = 0; j < i; ++j)
+				ConcurrentFree(out[j], size);
+			throw;
+		}
+		return;
+	}
+
+	cache->AllocateBatch(size, n, out);
+	for (size_t i = 0; i < n; ++i)
+	{
+		SampleAlloc(out[i], size);
+		TraceAlloc(out[i], size);
+	}
+}
+
+//释放ConcurrentAllocBatch(或者ConcurrentAlloc)申请的n个size大小的对象，size为0时按span查大小
+static inline void ConcurrentFreeBatch(void** ptrs, size_t n, size_t size)
+{
+	ThreadCache* cache = tlslist;
+	if (cache == nullptr && size != 0 && size <= MAX_BYTES && !CpuCache::Enabled())
+		cache = CreateThreadCache();
+
+	if (size == 0 || size > MAX_BYTES || CpuCache::Enabled() || cache == nullptr)
+	{
+		for (size_t i = 0; i < n; ++i)
+			ConcurrentFree(ptrs[i], size);
+		return;
+	}
+
+	for (size_t i = 0; i < n; ++i)
+	{
+		SampleFree(ptrs[i]);
+		TraceFree(ptrs[i]);
+	}
+	cache->DeallocateBatch(ptrs, n, size);
+}
+
+//按类型申请一个T大小的对象，sizeof(T)是编译期常量，
+//自由链表的位置和对齐后的大小也在编译期算好，内联后快路径就是一次自由链表的弹出
+template <class T, bool Small = (sizeof(T) <= MAX_BYTES)>
+struct TypedAlloc
+{
+	static T* Alloc()
+	{
+		typedef SizeClassOf<sizeof(T)> Class;
+		void* ptr = _SmallAllocIndex(Class::index, Class::size);
+		SampleAlloc(ptr, sizeof(T));
+		TraceAlloc(ptr, sizeof(T));
+		return static_cast<T*>(ptr);
+	}
+
+	static void Free(T* ptr)
+	{
+		typedef SizeClassOf<sizeof(T)> Class;
+		SampleFree(ptr);
+		TraceFree(ptr);
+		_SmallFreeIndex(ptr, Class::index, Class::size);
+	}
+};
+
+//大对象没有自由链表，走普通路径
+template <class T>
+struct TypedAlloc<T, false>
+{
+	static T* Alloc()
+	{
+		return static_cast<T*>(ConcurrentAlloc(sizeof(T)));
+	}
+
+	static void Free(T* ptr)
+	{
+		ConcurrentFree(ptr, sizeof(T));
+	}
+};
+
+template <class T>
+static inline T* ConcurrentAllocT()
+{
+	return TypedAlloc<T>::Alloc();
+}
+
+//ptr必须是ConcurrentAllocT<T>(或者ConcurrentAlloc(sizeof(T)))申请的
+template <class T>
+static inline void ConcurrentFreeT(T* ptr)
+{
+	TypedAlloc<T>::Free(ptr);
+}
@@ -0,0 +1,83 @@
+#include "CpuCache.h"
+#include <new>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+static bool ReadEnabled()
+{
+#ifdef USE_CPU_CACHE
+	bool enabled = true;
+#else
+	bool enabled = false;
+#endif
+	const char* env = getenv("CONCURRENT_ALLOC_CPU_CACHE");
+	if (env != nullptr)
+		enabled = (env[0] != '0');
+	return enabled;
+}
+
+std::atomic<bool> CpuCache::_enabled(ReadEnabled());
+
+//第一次使用时按CPU个数分配槽位，直接向系统申请
+void CpuCache::_Init()
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	long ncpu = (long)info.dwNumberOfProcessors;
+#else
+	long ncpu = sysconf(_SC_NPROCESSORS_CONF);
+#endif
+	if (ncpu <= 0)
+		ncpu = 1;
+
+	size_t bytes = ncpu * sizeof(Slot);
+	Slot* slots = (Slot*)SystemAlloc(SizeClass::_Roundup(bytes, PAGE_SHIFT) >> PAGE_SHIFT);
+	if (slots == nullptr)
+		throw std::bad_alloc();
+	for (long i = 0; i < ncpu; ++i)
+		new(&slots[i]) Slot;
+
+	_ncpu = ncpu;
+	_slots.store(slots, std::memory_order_release);
+}
+
+CpuCache::Slot* CpuCache::CurrentSlot()
+{
+	Slot* slots = _slots.load(std::memory_order_acquire);
+	if (slots == nullptr)
+	{
+		std::call_once(_once, &CpuCache::_Init, this);
+		slots = _slots.load(std::memory_order_acquire);
+	}
+
+	return &slots[CurrentCpu() % _ncpu];
+}
+
+void* CpuCache::Allocate(size_t size)
+{
+	Slot* slot = CurrentSlot();
+	slot->_lock.Lock();
+	void* ptr = nullptr;
+	try
+	{
+		ptr = slot->_cache.Allocate(size);
+	}
+	catch (...)
+	{
+		slot->_lock.Unlock();
+		throw;
+	}
+	slot->_lock.Unlock();
+	return ptr;
+}
+
+void CpuCache::Deallocate(void* ptr, size_t size)
+{
+	Slot* slot = CurrentSlot();
+	slot->_lock.Lock();
+	slot->_cache.Deallocate(ptr, size);
+	slot->_lock.Unlock();
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "Common.h"
+#include "ThreadCache.h"
+
+//ThreadCache的另一种前端：每个CPU一个用自旋锁保护的缓存，缓存的内存只和核数有关
+//默认关闭，定义USE_CPU_CACHE或者设置环境变量CONCURRENT_ALLOC_CPU_CACHE=0/1切换，两种前端的对象可以互相释放
+//单例模式
+class CpuCache
+{
+public:
+	static CpuCache* GetInstence()
+	{
+		//第一次使用时在静态存储上构造，并且永远不析构，
+		//替换系统malloc后可能在静态对象构造之前或者析构之后被调用
+		static std::aligned_storage<sizeof(CpuCache), alignof(CpuCache)>::type storage;
+		static CpuCache* inst = new(&storage) CpuCache;
+		return inst;
+	}
+
+	static bool Enabled()
+	{
+		return _enabled.load(std::memory_order_relaxed);
+	}
+	static void SetEnabled(bool enabled)
+	{
+		_enabled.store(enabled, std::memory_order_relaxed);
+	}
+
+	void* Allocate(size_t size);
+	void Deallocate(void* ptr, size_t size);
+
+private:
+	//每个CPU一个槽位，按缓存行对齐，避免伪共享
+	struct alignas(64) Slot
+	{
+		SpinLock _lock;
+		ThreadCache _cache;
+	};
+
+	void _Init();
+	Slot* CurrentSlot();
+
+	std::atomic<Slot*> _slots{ nullptr };
+	size_t _ncpu = 0;
+	std::once_flag _once;
+
+	static std::atomic<bool> _enabled;
+
+private:
+	CpuCache(){}
+	CpuCache(const CpuCache&) = delete;
+};
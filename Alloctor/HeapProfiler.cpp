@@ -0,0 +1,256 @@
+#include "HeapProfiler.h"
+#include <math.h>
+#include <chrono>
+
+#ifndef _WIN32
+#include <execinfo.h>
+#endif
+
+//初始为0，每个线程第一次申请时进入慢路径，看一下有没有打开采样
+thread_local long long tlssamplebytes = 0;
+static thread_local unsigned long long tlsrandom = 0; //几何分布用的随机数状态
+static thread_local bool tlsinsampler = false; //记录调用栈时可能再申请内存，防止递归采样
+
+static const size_t BUSY = 1;
+
+static size_t ReadSampleRate()
+{
+	//静态初始化之前申请过内存的话，计数已经被设成SAMPLE_RECHECK，这里让当前线程立刻生效
+	tlssamplebytes = 0;
+	const char* env = getenv("CONCURRENT_ALLOC_SAMPLE_RATE");
+	return env == nullptr ? 0 : (size_t)strtoull(env, nullptr, 10);
+}
+
+std::atomic<size_t> HeapProfiler::_rate(ReadSampleRate());
+std::atomic<size_t> HeapProfiler::_live(0);
+
+//抓调用栈，跳过采样器自己的栈帧
+static size_t CaptureStack(void** stack, size_t depth)
+{
+#ifdef _WIN32
+	return CaptureStackBackTrace(2, (DWORD)depth, stack, NULL);
+#else
+	void* frames[SAMPLE_DEPTH + 2];
+	int n = backtrace(frames, (int)(depth + 2));
+	if (n <= 2)
+		return 0;
+	memcpy(stack, frames + 2, (n - 2) * sizeof(void*));
+	return n - 2;
+#endif
+}
+
+void HeapProfiler::SetSampleRate(size_t rate)
+{
+	if (rate != 0)
+	{
+		//glibc的backtrace第一次调用时会加载libgcc_s并申请内存，提前在这里调用一次
+		void* stack[SAMPLE_DEPTH];
+		tlsinsampler = true;
+		CaptureStack(stack, SAMPLE_DEPTH);
+		tlsinsampler = false;
+		_Table();
+	}
+	_rate.store(rate, std::memory_order_relaxed);
+	//当前线程立刻生效
+	tlssamplebytes = 0;
+}
+
+HeapProfiler::Sample* HeapProfiler::_Table()
+{
+	Sample* table = _table.load(std::memory_order_acquire);
+	if (table == nullptr)
+	{
+		std::call_once(_once, [this]() {
+			//直接向系统申请，新映射的页都是0，所有位置都是空的
+			size_t bytes = SAMPLE_SLOTS * sizeof(Sample);
+			Sample* slots = (Sample*)SystemAlloc(SizeClass::_Roundup(bytes, PAGE_SHIFT) >> PAGE_SHIFT);
+			_table.store(slots, std::memory_order_release);
+		});
+		table = _table.load(std::memory_order_acquire);
+	}
+	return table;
+}
+
+size_t HeapProfiler::_Hash(void* ptr)
+{
+	//对象至少8字节对齐，低位没有信息
+	return (size_t)(((unsigned long long)ptr >> 3) * 0x9E3779B97F4A7C15ULL >> 32) & (SAMPLE_SLOTS - 1);
+}
+
+//下一次采样前要申请的字节数，服从均值为rate的几何分布(用指数分布近似)
+size_t HeapProfiler::_NextSample(size_t rate)
+{
+	if (tlsrandom == 0)
+	{
+		tlsrandom = (unsigned long long)(size_t)&tlsrandom
+			^ (unsigned long long)std::chrono::steady_clock::now().time_since_epoch().count();
+		if (tlsrandom == 0)
+			tlsrandom = 1;
+	}
+
+	//xorshift64
+	tlsrandom ^= tlsrandom << 13;
+	tlsrandom ^= tlsrandom >> 7;
+	tlsrandom ^= tlsrandom << 17;
+
+	//取53位得到(0,1]之间的均匀分布
+	double u = ((tlsrandom >> 11) + 1) * (1.0 / 9007199254740992.0);
+	double next = -log(u) * (double)rate;
+	return next < 1.0 ? 1 : (size_t)next;
+}
+
+void HeapProfiler::RecordAlloc(void* ptr, size_t size)
+{
+	size_t rate = _rate.load(std::memory_order_relaxed);
+	if (rate == 0)
+	{
+		tlssamplebytes = (long long)SAMPLE_RECHECK;
+		return;
+	}
+	tlssamplebytes = (long long)_NextSample(rate);
+
+	if (tlsinsampler)
+		return;
+	tlsinsampler = true;
+	GetInstence()->_Insert(ptr, size);
+	tlsinsampler = false;
+}
+
+void HeapProfiler::_Insert(void* ptr, size_t size)
+{
+	Sample* table = _Table();
+	bool inserted = false;
+	if (table != nullptr)
+	{
+		size_t index = _Hash(ptr);
+		for (size_t i = 0; i < SAMPLE_PROBES; ++i)
+		{
+			Sample& sample = table[(index + i) & (SAMPLE_SLOTS - 1)];
+			size_t expected = 0;
+			if (sample._key.compare_exchange_strong(expected, BUSY, std::memory_order_acquire))
+			{
+				sample._size = size;
+				sample._depth = CaptureStack(sample._stack, SAMPLE_DEPTH);
+				sample._key.store((size_t)ptr, std::memory_order_release);
+				inserted = true;
+				break;
+			}
+		}
+	}
+
+	if (inserted)
+		_live.fetch_add(1, std::memory_order_relaxed);
+	else
+		_dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+void HeapProfiler::RecordFree(void* ptr)
+{
+	Sample* table = _table.load(std::memory_order_acquire);
+	if (table == nullptr)
+		return;
+
+	//插入时最多探测SAMPLE_PROBES个位置，查找也只看这么多，不需要墓碑
+	size_t index = _Hash(ptr);
+	for (size_t i = 0; i < SAMPLE_PROBES; ++i)
+	{
+		Sample& sample = table[(index + i) & (SAMPLE_SLOTS - 1)];
+		size_t expected = (size_t)ptr;
+		if (sample._key.load(std::memory_order_relaxed) == expected
+			&& sample._key.compare_exchange_strong(expected, 0, std::memory_order_acq_rel))
+		{
+			_live.fetch_sub(1, std::memory_order_relaxed);
+			return;
+		}
+	}
+}
+
+void HeapProfiler::Dump(FILE* out)
+{
+	struct Record
+	{
+		size_t _count;
+		size_t _bytes;
+		size_t _depth;
+		void* _stack[SAMPLE_DEPTH];
+	};
+
+	//输出过程中申请的内存不采样
+	bool insampler = tlsinsampler;
+	tlsinsampler = true;
+
+	std::vector<Record> records;
+	Sample* table = _table.load(std::memory_order_acquire);
+	for (size_t i = 0; table != nullptr && i < SAMPLE_SLOTS; ++i)
+	{
+		Sample& sample = table[i];
+		size_t key = sample._key.load(std::memory_order_acquire);
+		if (key <= BUSY)
+			continue;
+
+		Record record;
+		record._count = 1;
+		record._bytes = sample._size;
+		record._depth = sample._depth;
+		memcpy(record._stack, sample._stack, sizeof(record._stack));
+		//读的过程中被删除了就跳过
+		if (sample._key.load(std::memory_order_acquire) != key)
+			continue;
+		records.push_back(record);
+	}
+
+	//相同调用栈的合并
+	std::sort(records.begin(), records.end(), [](const Record& a, const Record& b) {
+		if (a._depth != b._depth)
+			return a._depth < b._depth;
+		return memcmp(a._stack, b._stack, a._depth * sizeof(void*)) < 0;
+	});
+	size_t n = 0;
+	for (size_t i = 0; i < records.size(); ++i)
+	{
+		if (n > 0 && records[n - 1]._depth == records[i]._depth
+			&& memcmp(records[n - 1]._stack, records[i]._stack, records[i]._depth * sizeof(void*)) == 0)
+		{
+			records[n - 1]._count += records[i]._count;
+			records[n - 1]._bytes += records[i]._bytes;
+		}
+		else
+		{
+			records[n++] = records[i];
+		}
+	}
+	records.resize(n);
+
+	size_t count = 0, bytes = 0;
+	for (const Record& record : records)
+	{
+		count += record._count;
+		bytes += record._bytes;
+	}
+
+	//pprof按heap_v2的采样率自己换算出实际的大小
+	fprintf(out, "heap profile: %6zu: %8zu [%6zu: %8zu] @ heap_v2/%zu\n", count, bytes, count, bytes, SampleRate());
+	for (const Record& record : records)
+	{
+		fprintf(out, "%6zu: %8zu [%6zu: %8zu] @", record._count, record._bytes, record._count, record._bytes);
+		for (size_t i = 0; i < record._depth; ++i)
+			fprintf(out, " %p", record._stack[i]);
+		fprintf(out, "\n");
+	}
+
+#ifndef _WIN32
+	//pprof需要映射信息才能把地址换成符号
+	fprintf(out, "\nMAPPED_LIBRARIES:\n");
+	FILE* maps = fopen("/proc/self/maps", "r");
+	if (maps != nullptr)
+	{
+		char buf[4096];
+		size_t len;
+		while ((len = fread(buf, 1, sizeof(buf), maps)) > 0)
+			fwrite(buf, 1, len, out);
+		fclose(maps);
+	}
+#endif
+
+	tlsinsampler = insampler;
+}
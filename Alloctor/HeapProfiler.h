@@ -0,0 +1,103 @@
+#pragma once
+
+#include "Common.h"
+#include <stdio.h>
+
+const size_t SAMPLE_DEPTH = 32; //每个采样最多记录的栈帧数
+const size_t SAMPLE_SLOTS = 1 << 14; //采样表的大小
+const size_t SAMPLE_PROBES = 32; //插入和查找时最多探测的位置数
+const size_t SAMPLE_RECHECK = (size_t)1 << 26; //关闭采样时每申请这么多字节才重新看一次采样率
+
+//距离下一次采样还剩多少字节，申请时只做一次减法，减到负数才进入慢路径
+extern thread_local long long tlssamplebytes;
+
+//采样的堆分析器，不用valgrind就能看出线上进程里的内存是哪里申请的
+//平均每申请采样率这么多字节就按几何分布随机采一次，记录调用栈，释放时删除，
+//任何时候都可以把还活着的采样按pprof的堆文件格式输出
+//
+//采样表是固定大小的开放寻址哈希表，每个位置用原子指针加锁，插入、删除、输出都不需要全局锁
+//默认关闭，可以调用SetSampleRate或者设置环境变量CONCURRENT_ALLOC_SAMPLE_RATE打开
+//单例模式
+class HeapProfiler
+{
+public:
+	static HeapProfiler* GetInstence()
+	{
+		//第一次使用时在静态存储上构造，并且永远不析构，
+		//替换系统malloc后可能在静态对象构造之前或者析构之后被调用
+		static std::aligned_storage<sizeof(HeapProfiler), alignof(HeapProfiler)>::type storage;
+		static HeapProfiler* inst = new(&storage) HeapProfiler;
+		return inst;
+	}
+
+	//有没有还活着的采样，没有时释放不需要查表
+	static bool HasLive()
+	{
+		return _live.load(std::memory_order_relaxed) != 0;
+	}
+
+	//平均每rate字节采样一次，0表示关闭
+	//其他线程最多再申请SAMPLE_RECHECK字节后生效
+	void SetSampleRate(size_t rate);
+	static size_t SampleRate()
+	{
+		return _rate.load(std::memory_order_relaxed);
+	}
+
+	//计数减到负数时调用，决定是否采样并重新设置计数
+	//可能在单例构造之前被调用，所以是静态的
+	static void RecordAlloc(void* ptr, size_t size);
+	//ptr被采样过就删除它的记录
+	void RecordFree(void* ptr);
+
+	//还活着的采样个数，以及因为表满了丢掉的采样个数
+	size_t LiveSamples() const
+	{
+		return _live.load(std::memory_order_relaxed);
+	}
+	size_t DroppedSamples() const
+	{
+		return _dropped.load(std::memory_order_relaxed);
+	}
+
+	//按pprof的heap_v2格式输出还活着的采样，相同调用栈的合并成一行
+	void Dump(FILE* out);
+
+private:
+	struct Sample
+	{
+		std::atomic<size_t> _key; //0表示空，BUSY表示正在写，其他是对象地址
+		size_t _size;
+		size_t _depth;
+		void* _stack[SAMPLE_DEPTH];
+	};
+
+	Sample* _Table();
+	void _Insert(void* ptr, size_t size);
+	static size_t _Hash(void* ptr);
+	static size_t _NextSample(size_t rate);
+
+	std::atomic<Sample*> _table{ nullptr };
+	std::once_flag _once;
+	std::atomic<size_t> _dropped{ 0 };
+	static std::atomic<size_t> _rate;
+	static std::atomic<size_t> _live;
+
+private:
+	HeapProfiler(){}
+	HeapProfiler(const HeapProfiler&) = delete;
+};
+
+//申请之后调用，不采样时只有一次减法和一次比较
+static inline void SampleAlloc(void* ptr, size_t size)
+{
+	if ((tlssamplebytes -= (long long)size) < 0)
+		HeapProfiler::RecordAlloc(ptr, size);
+}
+
+//释放之前调用，ptr必须是申请时返回的地址
+static inline void SampleFree(void* ptr)
+{
+	if (HeapProfiler::HasLive())
+		HeapProfiler::GetInstence()->RecordFree(ptr);
+}
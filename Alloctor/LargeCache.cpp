@@ -0,0 +1,167 @@
+#include "LargeCache.h"
+#include "SystemAllocator.h"
+#include <chrono>
+
+//单调时钟，毫秒
+static size_t NowMs()
+{
+	return (size_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static size_t ReadLimit()
+{
+	const char* env = getenv("CONCURRENT_ALLOC_LARGE_CACHE_BYTES");
+	if (env == nullptr || env[0] == '\0')
+		return LARGE_CACHE_BYTES;
+	return (size_t)strtoull(env, nullptr, 10);
+}
+
+std::atomic<size_t> LargeCache::_limit(ReadLimit());
+std::atomic<size_t> LargeCache::_age(LARGE_CACHE_AGE);
+
+size_t LargeCache::_Bucket(size_t npage)
+{
+	assert(npage >= NPAGES);
+	size_t index = 0;
+	for (size_t n = npage >> 8; n != 0 && index + 1 < LARGE_CACHE_BUCKETS; n >>= 1)
+		++index;
+	return index;
+}
+
+void LargeCache::_Erase(Entry* entry)
+{
+	entry->_prev->_next = entry->_next;
+	entry->_next->_prev = entry->_prev;
+	_bytes -= entry->_npage << PAGE_SHIFT;
+}
+
+LargeCache::Entry* LargeCache::_Oldest()
+{
+	//每个桶最后一个就是这个桶里最早放进来的
+	Entry* oldest = nullptr;
+	for (size_t i = 0; i < LARGE_CACHE_BUCKETS; ++i)
+	{
+		Entry* last = _buckets[i]._prev;
+		if (last != &_buckets[i] && (oldest == nullptr || last->_seq < oldest->_seq))
+			oldest = last;
+	}
+	return oldest;
+}
+
+size_t LargeCache::_Evict(size_t keep, size_t now, size_t age, size_t want, Entry*& victims)
+{
+	size_t freed = 0;
+	Entry* oldest;
+	while ((oldest = _Oldest()) != nullptr
+		&& (_bytes > keep || now - oldest->_time >= age || freed < want))
+	{
+		_Erase(oldest);
+		++_evictions;
+		freed += oldest->_npage << PAGE_SHIFT;
+		oldest->_next = victims;
+		victims = oldest;
+	}
+	return freed;
+}
+
+//munmap不需要在锁里做
+void LargeCache::_Free(Entry* victims)
+{
+	while (victims != nullptr)
+	{
+		Entry* next = victims->_next;
+		SystemAllocator::GetInstence()->FreeHuge(victims, victims->_npage);
+		victims = next;
+	}
+}
+
+void* LargeCache::Get(size_t& npage)
+{
+	if (npage > LARGE_CACHE_MAX_PAGES)
+		return nullptr;
+
+	std::unique_lock<std::mutex> lock(_mutex);
+	//大小接近桶的上界时，合适的映射可能在下一个桶里
+	size_t index = _Bucket(npage);
+	for (size_t i = index; i < LARGE_CACHE_BUCKETS && i <= index + 1; ++i)
+	{
+		//从最近放进来的开始找，它的页更可能还在CPU缓存和TLB里
+		for (Entry* cur = _buckets[i]._next; cur != &_buckets[i]; cur = cur->_next)
+		{
+			if (cur->_npage >= npage && cur->_npage <= npage + npage / 8)
+			{
+				_Erase(cur);
+				++_hits;
+				npage = cur->_npage;
+				return cur;
+			}
+		}
+	}
+	++_misses;
+	return nullptr;
+}
+
+void LargeCache::Put(void* ptr, size_t npage)
+{
+	size_t limit = Limit();
+	if (npage > LARGE_CACHE_MAX_PAGES || (npage << PAGE_SHIFT) > limit)
+	{
+		SystemAllocator::GetInstence()->FreeHuge(ptr, npage);
+		return;
+	}
+
+	size_t now = NowMs();
+	size_t age = _age.load(std::memory_order_relaxed);
+	Entry* victims = nullptr;
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		Entry* entry = (Entry*)ptr;
+		Entry* head = &_buckets[_Bucket(npage)];
+		entry->_npage = npage;
+		entry->_time = now;
+		entry->_seq = ++_seq;
+		entry->_prev = head;
+		entry->_next = head->_next;
+		head->_next->_prev = entry;
+		head->_next = entry;
+		_bytes += npage << PAGE_SHIFT;
+
+		//超过上限的、放得太久的都还给系统，刚放进来的这个不会超过上限，也不会太久
+		_Evict(limit, now, age, 0, victims);
+	}
+	_Free(victims);
+}
+
+size_t LargeCache::Trim(size_t age)
+{
+	Entry* victims = nullptr;
+	size_t freed;
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		freed = _Evict((size_t)-1, NowMs(), age, 0, victims);
+	}
+	_Free(victims);
+	return freed;
+}
+
+size_t LargeCache::Release(size_t bytes)
+{
+	Entry* victims = nullptr;
+	size_t freed;
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		freed = _Evict((size_t)-1, NowMs(), (size_t)-1, bytes, victims);
+	}
+	_Free(victims);
+	return freed;
+}
+
+void LargeCache::GetStats(AllocatorStats& stats)
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	stats._largecachebytes = _bytes;
+	stats._largecachehits = _hits;
+	stats._largecachemisses = _misses;
+	stats._largecacheevictions = _evictions;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "Common.h"
+#include "Stats.h"
+
+const size_t LARGE_CACHE_BYTES = 64 * 1024 * 1024; //默认最多缓存的字节数
+const size_t LARGE_CACHE_AGE = 1000; //默认缓存超过多少毫秒还没有被重新用到就还给系统
+const size_t LARGE_CACHE_MAX_PAGES = 4096; //超过16M的映射不缓存
+const size_t LARGE_CACHE_BUCKETS = 6; //按页数的2的幂分桶，[128,256)到[4096,8192)
+
+//最近释放的直接映射的大对象(超过128页)的缓存，PageCache::AllocBigPageObj先在这里找，
+//找不到再向系统映射，反复申请释放差不多大的大缓冲区时不用每次都mmap/munmap
+//每个桶内按释放时间排序，超过时间或者总字节数超过上限时，最早释放的映射先还给系统
+//链表节点放在缓存的映射自己的第一页里，不需要额外的元数据
+//单例模式
+class LargeCache
+{
+public:
+	static LargeCache* GetInstence()
+	{
+		//第一次使用时在静态存储上构造，并且永远不析构，
+		//替换系统malloc后可能在静态对象构造之前或者析构之后被调用
+		static std::aligned_storage<sizeof(LargeCache), alignof(LargeCache)>::type storage;
+		static LargeCache* inst = new(&storage) LargeCache;
+		return inst;
+	}
+
+	//取一个至少npage页、最多多出npage/8页的映射，npage改成实际的页数，没有时返回nullptr
+	void* Get(size_t& npage);
+	//缓存一个不再使用的映射，放不下时直接还给系统
+	void Put(void* ptr, size_t npage);
+
+	//把缓存超过age毫秒的映射还给系统，返回还回去的字节数
+	size_t Trim(size_t age);
+	//至少把bytes字节还给系统(不够就全部还回去)，返回实际还回去的字节数
+	size_t Release(size_t bytes);
+
+	//填写缓存的字节数和命中次数
+	void GetStats(AllocatorStats& stats);
+
+	//缓存的字节数上限和最长缓存时间，设置环境变量CONCURRENT_ALLOC_LARGE_CACHE_BYTES修改上限，0表示不缓存
+	static void SetLimit(size_t bytes, size_t age = LARGE_CACHE_AGE)
+	{
+		_limit.store(bytes, std::memory_order_relaxed);
+		_age.store(age, std::memory_order_relaxed);
+	}
+	static size_t Limit()
+	{
+		return _limit.load(std::memory_order_relaxed);
+	}
+
+private:
+	struct Entry
+	{
+		Entry* _prev;
+		Entry* _next;
+		size_t _npage;
+		size_t _time; //放进缓存的时间
+		size_t _seq; //放进缓存的顺序，同一毫秒内放进来的也能分出先后
+	};
+
+	static size_t _Bucket(size_t npage);
+	void _Erase(Entry* entry);
+	//所有桶里最早放进来的映射
+	Entry* _Oldest();
+	//从最早放进来的开始摘下，直到剩下的不超过keep字节、没有放了age毫秒以上的、并且摘下了want字节，
+	//摘下的挂到victims上，返回摘下的字节数
+	size_t _Evict(size_t keep, size_t now, size_t age, size_t want, Entry*& victims);
+	void _Free(Entry* victims);
+
+	Entry _buckets[LARGE_CACHE_BUCKETS]; //带头双向循环链表，新放进来的在前面
+	std::mutex _mutex;
+	size_t _bytes = 0;
+	size_t _seq = 0;
+	size_t _hits = 0;
+	size_t _misses = 0;
+	size_t _evictions = 0;
+
+	static std::atomic<size_t> _limit;
+	static std::atomic<size_t> _age;
+
+private:
+	LargeCache()
+	{
+		for (size_t i = 0; i < LARGE_CACHE_BUCKETS; ++i)
+		{
+			_buckets[i]._prev = &_buckets[i];
+			_buckets[i]._next = &_buckets[i];
+		}
+	}
+	LargeCache(const LargeCache&) = delete;
+};
@@ -0,0 +1,219 @@
+// 用内存池替换系统的malloc/free和全局的operator new/delete
+// 编译成动态库后可以直接 LD_PRELOAD=libconcurrentalloc.so ./a.out，不需要修改代码
+// 只支持glibc的Linux
+
+#include "ConcurrentAlloc.h"
+#include <errno.h>
+#include <malloc.h>
+
+// malloc要保证返回的地址能存放任何基本类型(16字节对齐)
+// 自由链表的大小按16的倍数取整后，切出来的对象天然就是16字节对齐的
+const size_t MIN_ALIGN = 16;
+
+static inline void* _Malloc(size_t size)
+{
+	if (size == 0)
+		size = 1;
+	size = SizeClass::_Roundup(size, 4);
+	try
+	{
+		return ConcurrentAlloc(size);
+	}
+	catch (...)
+	{
+		errno = ENOMEM;
+		return nullptr;
+	}
+}
+
+static inline void _Free(void* ptr)
+{
+	if (ptr != nullptr)
+		ConcurrentFree(ptr);
+}
+
+static inline void* _Memalign(size_t align, size_t size)
+{
+	if (align <= MIN_ALIGN)
+		return _Malloc(size);
+
+	try
+	{
+		return ConcurrentAllocAligned(size == 0 ? 1 : size, align);
+	}
+	catch (...)
+	{
+		errno = ENOMEM;
+		return nullptr;
+	}
+}
+
+extern "C"
+{
+
+void* malloc(size_t size) noexcept
+{
+	return _Malloc(size);
+}
+
+void free(void* ptr) noexcept
+{
+	_Free(ptr);
+}
+
+void cfree(void* ptr) noexcept
+{
+	_Free(ptr);
+}
+
+void* calloc(size_t n, size_t size) noexcept
+{
+	size_t bytes = n * size;
+	if (size != 0 && bytes / size != n)
+	{
+		errno = ENOMEM;
+		return nullptr;
+	}
+
+	void* ptr = _Malloc(bytes);
+	if (ptr != nullptr)
+		memset(ptr, 0, bytes);
+	return ptr;
+}
+
+void* realloc(void* ptr, size_t size) noexcept
+{
+	if (ptr == nullptr)
+		return _Malloc(size);
+	if (size == 0)
+	{
+		_Free(ptr);
+		return nullptr;
+	}
+
+	try
+	{
+		return ConcurrentRealloc(ptr, SizeClass::_Roundup(size, 4));
+	}
+	catch (...)
+	{
+		errno = ENOMEM;
+		return nullptr;
+	}
+}
+
+void* memalign(size_t align, size_t size) noexcept
+{
+	if (align == 0 || (align & (align - 1)) != 0)
+	{
+		errno = EINVAL;
+		return nullptr;
+	}
+	return _Memalign(align, size);
+}
+
+void* aligned_alloc(size_t align, size_t size) noexcept
+{
+	return memalign(align, size);
+}
+
+int posix_memalign(void** memptr, size_t align, size_t size) noexcept
+{
+	if (align == 0 || (align & (align - 1)) != 0 || align % sizeof(void*) != 0)
+		return EINVAL;
+
+	void* ptr = _Memalign(align, size);
+	if (ptr == nullptr)
+		return ENOMEM;
+	*memptr = ptr;
+	return 0;
+}
+
+void* valloc(size_t size) noexcept
+{
+	return _Memalign((size_t)1 << PAGE_SHIFT, size);
+}
+
+void* pvalloc(size_t size) noexcept
+{
+	size = SizeClass::_Roundup(size == 0 ? 1 : size, PAGE_SHIFT);
+	return _Memalign((size_t)1 << PAGE_SHIFT, size);
+}
+
+size_t malloc_usable_size(void* ptr) noexcept
+{
+	if (ptr == nullptr)
+		return 0;
+	return ConcurrentUsableSize(ptr);
+}
+
+} // extern "C"
+
+// operator new 失败时按标准调用new_handler，没有new_handler就抛出bad_alloc
+static inline void* _NewImpl(size_t size)
+{
+	for (;;)
+	{
+		void* ptr = _Malloc(size);
+		if (ptr != nullptr)
+			return ptr;
+
+		std::new_handler handler = std::get_new_handler();
+		if (handler == nullptr)
+			throw std::bad_alloc();
+		handler();
+	}
+}
+
+void* operator new(size_t size)
+{
+	return _NewImpl(size);
+}
+
+void* operator new[](size_t size)
+{
+	return _NewImpl(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+	return _Malloc(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+	return _Malloc(size);
+}
+
+void operator delete(void* ptr) noexcept
+{
+	_Free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+	_Free(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept
+{
+	_Free(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept
+{
+	_Free(ptr);
+}
+
+// C++14的带大小的delete，大小按_Malloc同样的规则取整后就能直接找到自由链表
+void operator delete(void* ptr, size_t size) noexcept
+{
+	if (ptr != nullptr)
+		ConcurrentFree(ptr, SizeClass::_Roundup(size == 0 ? 1 : size, 4));
+}
+
+void operator delete[](void* ptr, size_t size) noexcept
+{
+	if (ptr != nullptr)
+		ConcurrentFree(ptr, SizeClass::_Roundup(size == 0 ? 1 : size, 4));
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "Common.h"
+#include "SystemAllocator.h"
+#include <new>
+
+const size_t POOL_PAGES = 16; //每次向系统要的页数
+
+//定长对象池，用来管理分配器自己的元数据(比如Span)
+//内存按页从SystemAllocator切出来，释放的对象挂在自由链表上，申请和释放都是O(1)
+//不会再进入系统的malloc/new，本身不加锁，由使用者保证互斥
+template <class T>
+class ObjectPool
+{
+private:
+	char* _memory = nullptr; //当前大块内存中还没切出去的部分
+	size_t _remain = 0; //当前大块内存剩余的字节数
+	void* _freelist = nullptr; //还回来的对象
+
+	//对象至少要能放下一个指针
+	static const size_t OBJ_SIZE = sizeof(T) < sizeof(void*) ? sizeof(void*) : sizeof(T);
+
+public:
+	T* New()
+	{
+		void* obj = nullptr;
+		if (_freelist != nullptr)
+		{
+			obj = _freelist;
+			_freelist = NEXT_OBJ(_freelist);
+		}
+		else
+		{
+			if (_remain < OBJ_SIZE)
+			{
+				size_t npage = POOL_PAGES;
+				if ((npage << PAGE_SHIFT) < OBJ_SIZE)
+					npage = SizeClass::_Roundup(OBJ_SIZE, PAGE_SHIFT) >> PAGE_SHIFT;
+
+				_memory = (char*)SystemAllocator::GetInstence()->AllocPages(npage);
+				if (_memory == nullptr)
+					throw std::bad_alloc();
+				_remain = npage << PAGE_SHIFT;
+			}
+
+			obj = _memory;
+			_memory += OBJ_SIZE;
+			_remain -= OBJ_SIZE;
+		}
+
+		return new(obj) T; //定位new调用构造函数
+	}
+
+	void Delete(T* obj)
+	{
+		obj->~T();
+		Release(obj);
+	}
+
+	//只回收内存，对象已经析构过了
+	void Release(T* obj)
+	{
+		NEXT_OBJ(obj) = _freelist;
+		_freelist = obj;
+	}
+};
@@ -1,6 +1,20 @@
 #include "PageCache.h"
+#include "SystemAllocator.h"
+#include "LargeCache.h"
+#include "CentralCache.h"
 
-PageCache PageCache::_inst;
+//当前线程使用的分片，同一个CPU上的线程落在同一个分片
+static size_t CurrentShard()
+{
+	return CurrentCpu() % NSHARDS;
+}
+
+//单调时钟，毫秒
+static size_t NowMs()
+{
+	return (size_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
 
 //大对象申请，直接从系统
@@ -17,30 +31,38 @@ Span* PageCache::AllocBigPageObj(size_t size)
 		span->_usecount = 1;
 		return span;
 	}
-	else//超过128页，向系统申请
+	else//超过128页，先找最近释放的映射，没有再向系统申请
 	{
-#ifdef _WIN32
-		void* ptr = VirtualAlloc(0, npage << PAGE_SHIFT,
-			MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
-#else 
-		void* ptr = malloc(npage << PAGE_SHIFT);
-#endif
-
+		void* ptr = LargeCache::GetInstence()->Get(npage);
+		if (ptr == nullptr)
+			ptr = SystemAllocator::GetInstence()->AllocHuge(npage);
 		if (ptr == nullptr)
 			throw std::bad_alloc();
 
-		Span* span = new Span;
+		//span对象池和基数树的写操作都需要加分片锁
+		size_t index = CurrentShard();
+		Shard& shard = _shards[index];
+		std::unique_lock<std::mutex> lock(shard._mutex, std::defer_lock);
+		LockCounted(lock, _waits);
+		Span* span = shard._spanpool.New();
+		span->_shard = index;
 		span->_npage = npage;
 		span->_pageid = (PageID)ptr >> PAGE_SHIFT;
 		span->_objsize = npage << PAGE_SHIFT;
+		span->_usecount = 1;
+		span->_isuse = true; //防止被相邻的span当作空闲span合并
 
-		_idspanmap[span->_pageid] = span;
+		//每一页都建立映射，按大于一页对齐返回的内部指针也能找到span
+		if (!_EnsureMap(span->_pageid, npage))
+			throw std::bad_alloc();
+		for (size_t i = 0; i < npage; ++i)
+			_idspanmap.Set(span->_pageid + i, span);
 
 		return span;
 	}
 }
 
-void PageCache::FreeBigPageObj(void* ptr, Span* span)
+void PageCache::FreeBigPageObj(void* /*ptr*/, Span* span)
 {
 	size_t npage = span->_objsize >> PAGE_SHIFT;
 	if (npage < NPAGES) //相当于还是小于128页
@@ -49,87 +71,213 @@ void PageCache::FreeBigPageObj(void* ptr, Span* span)
 	}
 	else
 	{
-		_idspanmap.erase(npage);
-		//void* ptr = (void*)(span->_pageid << PAGE_SHIFT);//是否可以这样做然后少传递一个参数
-		delete span;
-#ifdef _WIN32
-		VirtualFree(ptr, 0, MEM_RELEASE);
-#else 
-		free(ptr);
-#endif
+		//ptr可能是对齐后的内部指针，用span的起始地址释放
+		void* start = (void*)(span->_pageid << PAGE_SHIFT);
+		{
+			Shard& shard = _shards[span->_shard];
+			std::unique_lock<std::mutex> lock(shard._mutex, std::defer_lock);
+			LockCounted(lock, _waits);
+			for (size_t i = 0; i < npage; ++i)
+				_idspanmap.Set(span->_pageid + i, nullptr);
+			shard._spanpool.Delete(span);
+		}
+		LargeCache::GetInstence()->Put(start, npage);
+	}
+}
+
+bool PageCache::ResizeBigPageObj(Span* span, size_t size)
+{
+	assert(span->_objsize > MAX_BYTES);
+	size_t npage = SizeClass::_Roundup(size, PAGE_SHIFT) >> PAGE_SHIFT;
+	size_t oldnpage = span->_objsize >> PAGE_SHIFT;
+	if (npage == oldnpage)
+		return true;
+
+	if (oldnpage < NPAGES && npage > oldnpage && npage < NPAGES)
+		return _GrowSpan(span, npage);
+	if (oldnpage >= NPAGES && npage >= NPAGES)
+		return _ResizeHuge(span, npage);
+	return false;
+}
+
+bool PageCache::_GrowSpan(Span* span, size_t npage)
+{
+	Shard& shard = _shards[span->_shard];
+	std::unique_lock<std::mutex> lock(shard._mutex, std::defer_lock);
+	LockCounted(lock, _waits);
+
+	//和ReleaseSpanToPageCache向后合并的条件一样，同一区域的页一定属于同一个分片
+	size_t extra = npage - span->_npage;
+	PageID nextid = span->_pageid + span->_npage;
+	Span* next = _idspanmap.Get(nextid);
+	if (next == nullptr || next->_isuse || !SystemAllocator::SameRegion(nextid, span->_pageid)
+		|| next->_npage < extra)
+		return false;
+
+	shard._spanlist[next->_npage].Erase(next);
+	for (size_t i = 0; i < extra; ++i)
+		_idspanmap.Set(nextid + i, span);
+
+	//还给系统的页仍然可以访问，再次访问时由系统重新分配零页
+	if (next->_npage == extra)
+	{
+		shard._spanpool.Delete(next);
+	}
+	else
+	{
+		next->_pageid += extra;
+		next->_npage -= extra;
+		next->_objsize = next->_npage << PAGE_SHIFT;
+		shard._spanlist[next->_npage].PushFront(next);
+	}
+
+	span->_npage = npage;
+	span->_objsize = npage << PAGE_SHIFT;
+	return true;
+}
+
+bool PageCache::_ResizeHuge(Span* span, size_t npage)
+{
+	Shard& shard = _shards[span->_shard];
+	size_t oldnpage = span->_npage;
+	PageID oldid = span->_pageid;
+	void* start = (void*)(oldid << PAGE_SHIFT);
+
+	//新地址范围的映射节点在mremap之前准备好，之后只剩不会失败的Set，span不会落在两边都查不到的状态
+	//先原地改大小；缩小时先去掉尾部的映射，尾部被别的线程重新映射之后不会把它的映射清掉
+	{
+		std::unique_lock<std::mutex> lock(shard._mutex, std::defer_lock);
+		LockCounted(lock, _waits);
+		if (!_EnsureMap(oldid, npage))
+			return false;
+		for (size_t i = npage; i < oldnpage; ++i)
+			_idspanmap.Set(oldid + i, nullptr);
 	}
+
+	void* ptr = SystemAllocator::GetInstence()->ResizeHuge(start, oldnpage, npage);
+	void* dest = nullptr;
+	if (ptr == nullptr && npage > oldnpage)
+	{
+		//原地放不下，先预留新地址并准备好映射节点再搬家
+		dest = SystemAllocator::GetInstence()->ReserveHuge(npage);
+		if (dest != nullptr && _EnsureMap((PageID)dest >> PAGE_SHIFT, npage))
+		{
+			{
+				std::unique_lock<std::mutex> lock(shard._mutex, std::defer_lock);
+				LockCounted(lock, _waits);
+				for (size_t i = 0; i < oldnpage; ++i)
+					_idspanmap.Set(oldid + i, nullptr);
+			}
+			ptr = SystemAllocator::GetInstence()->ResizeHuge(start, oldnpage, npage, dest);
+		}
+		if (ptr == nullptr && dest != nullptr)
+			SystemAllocator::GetInstence()->UnreserveHuge(dest, npage);
+	}
+
+	std::unique_lock<std::mutex> lock(shard._mutex, std::defer_lock);
+	LockCounted(lock, _waits);
+	if (ptr != nullptr)
+	{
+		span->_pageid = (PageID)ptr >> PAGE_SHIFT;
+		span->_npage = npage;
+		span->_objsize = npage << PAGE_SHIFT;
+	}
+
+	//失败时恢复旧地址的映射，旧的映射节点一直都在
+	for (size_t i = 0; i < span->_npage; ++i)
+		_idspanmap.Set(span->_pageid + i, span);
+	return ptr != nullptr;
 }
 
 Span* PageCache::NewSpan(size_t n)
 {
 	// 加锁，防止多个线程同时到PageCache中申请span
-	// 这里必须是给全局加锁，不能单独的给每个桶加锁
+	// 这里必须是给整个分片加锁，不能单独的给每个桶加锁
 	// 如果对应桶没有span,是需要向系统申请的
-	// 可能存在多个线程同时向系统申请内存的可能
-	std::unique_lock<std::mutex> lock(_mutex);
-	return _NewSpan(n);
+	// 不同CPU上的线程使用不同的分片，互不影响
+	size_t index = CurrentShard();
+	Shard& shard = _shards[index];
+	std::unique_lock<std::mutex> lock(shard._mutex, std::defer_lock);
+	LockCounted(lock, _waits);
+	return _NewSpan(shard, index, n);
 }
 
+//基数树的中间节点是所有分片共享的，分配节点时单独加锁
+bool PageCache::_EnsureMap(PageID start, size_t n)
+{
+	std::unique_lock<std::mutex> lock(_mapmutex);
+	return _idspanmap.Ensure(start, n);
+}
 
 
-Span* PageCache::_NewSpan(size_t n)
+
+Span* PageCache::_NewSpan(Shard& shard, size_t index, size_t n)
 {
 	assert(n < NPAGES);
-	if (!_spanlist[n].Empty())
+	if (!shard._spanlist[n].Empty())
 	{
-		Span* span =_spanlist[n].PopFront();
-		span->_usecount = 1;
+		Span* span =shard._spanlist[n].PopFront();
+		span->_isuse = true;
+		//拿出去之后会被写入，不再是还给系统的状态
+		span->_released = false;
+		span->_freetime = 0;
 		return span;
 	}
 		
 
 	for (size_t i = n + 1; i < NPAGES; ++i)
 	{
-		if (!_spanlist[i].Empty())
+		if (!shard._spanlist[i].Empty())
 		{
 			//大内存对象拆分
-			Span* span = _spanlist[i].PopFront();
-			Span* splist = new Span;
+			Span* span = shard._spanlist[i].PopFront();
+			Span* splist = shard._spanpool.New();
 
 			splist->_pageid = span->_pageid;
 			splist->_npage = n;
 			splist->_objsize = splist->_npage << PAGE_SHIFT;
-			splist->_usecount = 1;//一次使用
+			splist->_isuse = true;
+			splist->_released = false;
+			splist->_freetime = 0;
+			splist->_shard = index;
 
 			span->_pageid = span->_pageid + n;
 			span->_npage = span->_npage - n;
 			span->_objsize = span->_npage << PAGE_SHIFT;
+			//剩下的部分还留在空闲链表里，保留原来的_released和_freetime
 
 
 			for (size_t j = 0; j < n; ++j)
-				_idspanmap[splist->_pageid + j] = splist;
+				_idspanmap.Set(splist->_pageid + j, splist);
 
-			//_spanlist[splist->_npage].PushFront(splist);
+			//shard._spanlist[splist->_npage].PushFront(splist);
 
-			_spanlist[span->_npage].PushFront(span);
+			shard._spanlist[span->_npage].PushFront(span);
 			return splist;
 		}
 	}
 
-	Span* span = new Span;
-
 	// 到这里说明SpanList中没有合适的span,只能向系统申请128页的内存
-#ifdef _WIN32
-	void* ptr = VirtualAlloc(0, (NPAGES - 1)*(1 << PAGE_SHIFT), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
-#else
-	//  brk
-	void* ptr=malloc((NPAGES - 1)*(1 << PAGE_SHIFT));
-#endif
-
+	// 拿到的内存是按页对齐的，所以页号和地址一一对应
+	void* ptr = SystemAllocator::GetInstence()->AllocPages(NPAGES - 1, index);
+	if (ptr == nullptr)
+		throw std::bad_alloc();
 
+	_spanbytes.Add((NPAGES - 1) << PAGE_SHIFT);
+	Span* span = shard._spanpool.New();
 	span->_pageid = (PageID)ptr >> PAGE_SHIFT;
 	span->_npage = NPAGES - 1;
+	span->_shard = index;
+
+	//新内存覆盖的叶子节点在这里一次性分配好，后面的Set不会再分配
+	if (!_EnsureMap(span->_pageid, span->_npage))
+		throw std::bad_alloc();
 
 	for (size_t i = 0; i < span->_npage; ++i)
-		_idspanmap[span->_pageid + i] = span;
+		_idspanmap.Set(span->_pageid + i, span);
 
-	_spanlist[span->_npage].PushFront(span);  //Span->_next  Span->_prev 
-	return _NewSpan(n);
+	shard._spanlist[span->_npage].PushFront(span);  //Span->_next  Span->_prev 
+	return _NewSpan(shard, index, n);
 }
 
 // 获取从对象到span的映射
@@ -137,57 +285,82 @@ Span* PageCache::MapObjectToSpan(void* obj)
 {
 	//计算页号
 	PageID id = (PageID)obj >> PAGE_SHIFT;
-	auto it = _idspanmap.find(id);
-	if (it != _idspanmap.end())
-	{
-		return it->second;
-	}
-	else
+	Span* span = _idspanmap.Get(id);
+	assert(span != nullptr);
+	return span;
+}
+
+void PageCache::ReleaseSpanToPageCache(Span* cur)
+{
+	// 必须上分片锁,可能多个线程一起从ThreadCache中归还数据
+	// span只会回到创建它的分片
+	Shard& shard = _shards[cur->_shard];
+	std::unique_lock<std::mutex> lock(shard._mutex, std::defer_lock);
+	LockCounted(lock, _waits);
+	_ReleaseSpan(shard, cur);
+}
+
+void PageCache::ReleaseSpansToPageCache(Span** spans, size_t n)
+{
+	//按分片排好，同一个分片的span在一次加锁里还回去
+	std::sort(spans, spans + n, [](const Span* a, const Span* b) {
+		return a->_shard < b->_shard;
+	});
+	for (size_t i = 0; i < n;)
 	{
-		assert(false);
-		return nullptr;
+		Shard& shard = _shards[spans[i]->_shard];
+		std::unique_lock<std::mutex> lock(shard._mutex, std::defer_lock);
+		LockCounted(lock, _waits);
+		size_t index = spans[i]->_shard;
+		for (; i < n && spans[i]->_shard == index; ++i)
+			_ReleaseSpan(shard, spans[i]);
 	}
 }
 
-void PageCache::ReleaseSpanToPageCache(Span* cur)
+void PageCache::_ReleaseSpan(Shard& shard, Span* cur)
 {
-	// 必须上全局锁,可能多个线程一起从ThreadCache中归还数据
-	std::unique_lock<std::mutex> lock(_mutex);
 	cur->_objsize = 0;
 	cur->_usecount = 0;
+	cur->_list = nullptr;
+	cur->_capacity = 0;
+	cur->_isuse = false;
 
 	// 向前合并
 	while (1)
 	{
 		PageID curid = cur->_pageid;
 		PageID previd = curid - 1;
-		auto it = _idspanmap.find(previd);
+		Span* prev = _idspanmap.Get(previd);
 
 		// 没有找到
-		if (it == _idspanmap.end())
+		if (prev == nullptr)
 			break;
 
-		// 前一个span不空闲
-		if (it->second->_usecount != 0)
+		// 不同区域的页可能属于别的分片，不能跨区域合并
+		if (!SystemAllocator::SameRegion(previd, curid))
 			break;
 
-		Span* prev = it->second;
+		// 前一个span不空闲
+		if (prev->_isuse)
+			break;
 
 		//超过128页则不合并
 		if (cur->_npage + prev->_npage > NPAGES - 1)
 			break;
 
 		// 先把prev从链表中移除
-		_spanlist[prev->_npage].Erase(prev);
+		shard._spanlist[prev->_npage].Erase(prev);
 
 		// 合并
 		prev->_npage += cur->_npage;
 		//修正id->span的映射关系
 		for (PageID i = 0; i < cur->_npage; ++i)
 		{
-			_idspanmap[cur->_pageid + i] = prev;
+			_idspanmap.Set(cur->_pageid + i, prev);
 		}
-		delete cur;
+		// 只要有一部分还驻留在内存中，合并后的span就当作没有还给系统
+		prev->_released = prev->_released && cur->_released;
+		shard._spanpool.Delete(cur);
 
 		// 继续向前合并
 		cur = prev;
@@ -201,39 +374,226 @@ void PageCache::ReleaseSpanToPageCache(Span* cur)
 
 		PageID curid = cur->_pageid;
 		PageID nextid = curid + cur->_npage;
-		//std::map<PageID, Span*>::iterator it = _idspanmap.find(nextid);
-		auto it = _idspanmap.find(nextid);
+		Span* next = _idspanmap.Get(nextid);
 
-		if (it == _idspanmap.end())
+		if (next == nullptr)
 			break;
 
-		if (it->second->_usecount != 0)
+		if (!SystemAllocator::SameRegion(nextid, curid))
 			break;
 
-		Span* next = it->second;
+		if (next->_isuse)
+			break;
 
 		//超过128页则不合并
 		if (cur->_npage + next->_npage >= NPAGES - 1)
 			break;
 
-		_spanlist[next->_npage].Erase(next);
+		shard._spanlist[next->_npage].Erase(next);
 
 
 		cur->_npage += next->_npage;
 		//修正id->Span的映射关系
 		for (PageID i = 0; i < next->_npage; ++i)
 		{
-			_idspanmap[next->_pageid + i] = cur;
+			_idspanmap.Set(next->_pageid + i, cur);
 		}
 
-		delete next;
+		cur->_released = cur->_released && next->_released;
+		shard._spanpool.Delete(next);
 	}
 
 	// 最后将合并好的span插入到span链中
-	_spanlist[cur->_npage].PushFront(cur);
+	cur->_freetime = NowMs();
+	shard._spanlist[cur->_npage].PushFront(cur);
 }
 
-PageCache::~PageCache()
+size_t PageCache::_ReleaseSpans(Shard& shard, size_t bytes, size_t idle)
+{
+	size_t now = NowMs();
+	size_t released = 0;
+
+	// 从大span开始还，系统调用次数少
+	for (size_t i = NPAGES - 1; i > 0; --i)
+	{
+		for (Span* span = shard._spanlist[i].Begin(); span != shard._spanlist[i].End(); span = span->_next)
+		{
+			if (span->_released || now - span->_freetime < idle)
+				continue;
+
+			if (SystemAllocator::HugePages())
+			{
+				released += _ReleaseHugePage(shard, span, now, idle);
+			}
+			else
+			{
+				SystemAllocator::GetInstence()->Release((void*)(span->_pageid << PAGE_SHIFT), span->_npage);
+				span->_released = true;
+				released += span->_npage << PAGE_SHIFT;
+			}
+			if (released >= bytes)
+				return released;
+		}
+	}
+	return released;
+}
+
+//使用透明大页时，只还span所在的整个大页，大页上的页全部空闲并且都超过了idle才还，
+//否则还掉一部分会把大页拆成普通页，还在使用的那部分也失去大页
+//区域按REGION_ALIGN对齐，一个大页一定在同一个区域里，也就是同一个分片里
+size_t PageCache::_ReleaseHugePage(Shard& shard, Span* span, size_t now, size_t idle)
+{
+	PageID first = span->_pageid & ~(PageID)(HUGEPAGE_PAGES - 1);
+	PageID last = first + HUGEPAGE_PAGES;
+	if (span->_pageid + span->_npage > last)
+		return 0; //跨两个大页的span不单独处理，两边的大页由完整落在里面的span触发
+
+	//第一个页可能属于从前一个大页开始的span
+	PageID id = first;
+	while (id < last)
+	{
+		Span* cur = _idspanmap.Get(id);
+		//还没有切成span的页(已提交但还没有用到)也算不空闲
+		if (cur == nullptr || cur->_isuse || now - cur->_freetime < idle)
+			return 0;
+		id = cur->_pageid + cur->_npage;
+	}
+
+	//跨大页边界的span在边界处切开，落在这个大页里的部分才能记成已经还给系统，不会在另一边被重复计算
+	Span* head = _idspanmap.Get(first);
+	if (head->_pageid < first)
+		_SplitFreeSpan(shard, head, first - head->_pageid);
+	Span* tail = _idspanmap.Get(last - 1);
+	if (tail->_pageid + tail->_npage > last)
+		_SplitFreeSpan(shard, tail, last - tail->_pageid);
+
+	//只算还没还给系统的页
+	size_t npage = 0;
+	for (id = first; id < last;)
+	{
+		Span* cur = _idspanmap.Get(id);
+		if (!cur->_released)
+			npage += cur->_npage;
+		id = cur->_pageid + cur->_npage;
+	}
+	if (npage == 0)
+		return 0;
+
+	SystemAllocator::GetInstence()->Release((void*)(first << PAGE_SHIFT), HUGEPAGE_PAGES);
+	for (id = first; id < last;)
+	{
+		Span* cur = _idspanmap.Get(id);
+		cur->_released = true;
+		id = cur->_pageid + cur->_npage;
+	}
+	return npage << PAGE_SHIFT;
+}
+
+void PageCache::_SplitFreeSpan(Shard& shard, Span* span, size_t n)
+{
+	assert(!span->_isuse && n > 0 && n < span->_npage);
+	Span* rest = shard._spanpool.New();
+	rest->_pageid = span->_pageid + n;
+	rest->_npage = span->_npage - n;
+	rest->_objsize = rest->_npage << PAGE_SHIFT;
+	rest->_isuse = false;
+	rest->_released = span->_released;
+	rest->_freetime = span->_freetime;
+	rest->_shard = span->_shard;
+	for (size_t i = 0; i < rest->_npage; ++i)
+		_idspanmap.Set(rest->_pageid + i, rest);
+
+	shard._spanlist[span->_npage].Erase(span);
+	span->_npage = n;
+	span->_objsize = n << PAGE_SHIFT;
+	shard._spanlist[span->_npage].PushFront(span);
+	shard._spanlist[rest->_npage].PushFront(rest);
+}
+
+size_t PageCache::Scavenge(size_t idle)
 {
+	//上次回收之后一直没用过的transfer cache先还给span，全部空闲的span才能回到这里
+	CentralCache::Getinstence()->ReleaseTransferCaches(true);
+	size_t released = 0;
+	for (size_t i = 0; i < NSHARDS; ++i)
+	{
+		std::unique_lock<std::mutex> lock(_shards[i]._mutex);
+		released += _ReleaseSpans(_shards[i], (size_t)-1, idle);
+	}
+	released += LargeCache::GetInstence()->Trim(idle);
+	return released;
+}
+
+size_t PageCache::ReleaseToSystem(size_t bytes)
+{
+	CentralCache::Getinstence()->ReleaseTransferCaches(false);
+	size_t released = 0;
+	for (size_t i = 0; i < NSHARDS && released < bytes; ++i)
+	{
+		std::unique_lock<std::mutex> lock(_shards[i]._mutex);
+		released += _ReleaseSpans(_shards[i], bytes - released, 0);
+	}
+	//空闲span不够时再把缓存的大对象映射还回去
+	if (released < bytes)
+		released += LargeCache::GetInstence()->Release(bytes - released);
+	return released;
+}
+
+void PageCache::GetStats(AllocatorStats& stats)
+{
+	stats._pagefreebytes = 0;
+	stats._pagereleasedbytes = 0;
+	stats._pagefreespans = 0;
+	for (size_t i = 0; i < NSHARDS; ++i)
+	{
+		Shard& shard = _shards[i];
+		std::unique_lock<std::mutex> lock(shard._mutex);
+		for (size_t j = 1; j < NPAGES; ++j)
+		{
+			for (Span* span = shard._spanlist[j].Begin(); span != shard._spanlist[j].End(); span = span->_next)
+			{
+				++stats._pagefreespans;
+				stats._pagefreebytes += span->_npage << PAGE_SHIFT;
+				if (span->_released)
+					stats._pagereleasedbytes += span->_npage << PAGE_SHIFT;
+			}
+		}
+	}
+	stats._spanbytes = _spanbytes.Get();
+	stats._pagelockwaits = _waits.Get();
+	LargeCache::GetInstence()->GetStats(stats);
+}
 
+void PageCache::StartScavenger(size_t period, size_t idle)
+{
+	StopScavenger();
+
+	_scavstop = false;
+	_scavenger = std::thread([this, period, idle]() {
+		std::unique_lock<std::mutex> lock(_scavmutex);
+		while (!_scavstop)
+		{
+			_scavcond.wait_for(lock, std::chrono::milliseconds(period));
+			if (!_scavstop)
+				Scavenge(idle);
+		}
+	});
+}
+
+void PageCache::StopScavenger()
+{
+	if (!_scavenger.joinable())
+		return;
+
+	{
+		std::unique_lock<std::mutex> lock(_scavmutex);
+		_scavstop = true;
+	}
+	_scavcond.notify_one();
+	_scavenger.join();
+}
+
+PageCache::~PageCache()
+{
+	StopScavenger();
 }
\ No newline at end of file
@@ -1,6 +1,11 @@
 #pragma once
 
 #include "Common.h"
+#include "PageMap.h"
+#include "ObjectPool.h"
+#include "Stats.h"
+#include <condition_variable>
+#include <chrono>
 
 //对于Page Cache也要设置为单例，对于Central Cache获取span的时候
 //每次都是从同一个page数组中获取span
@@ -10,29 +15,75 @@ class PageCache
 public:
 	static PageCache* GetInstence()
 	{
-		return &_inst;
+		//第一次使用时在静态存储上构造，并且永远不析构，
+		//替换系统malloc后可能在静态对象构造之前或者析构之后被调用
+		static std::aligned_storage<sizeof(PageCache), alignof(PageCache)>::type storage;
+		static PageCache* inst = new(&storage) PageCache;
+		return inst;
 	}
 
 	Span* AllocBigPageObj(size_t size);
 	void FreeBigPageObj(void* ptr, Span* span);
+	//把大对象的span原地改成至少size字节：span后面紧挨着的空闲span够大就直接并进来，
+	//直接映射的大对象用mremap(起始地址可能改变)，做不到时返回false，span不变
+	bool ResizeBigPageObj(Span* span, size_t size);
 
-	Span* _NewSpan(size_t n);
-	Span* NewSpan(size_t n);//获取的是以页为单位
+	Span* NewSpan(size_t n);//获取的是以页为单位，从当前CPU对应的分片中获取
 
 	//获取从对象到span的映射
 	Span* MapObjectToSpan(void* obj);
 
-	//释放空间span回到PageCache，并合并相邻的span
+	//释放空间span回到它所属的分片，并合并同一分片中相邻的span
 	void ReleaseSpanToPageCache(Span* span);
+	//一次还回去多个span，每个分片只加一次锁，spans会被重新排序
+	void ReleaseSpansToPageCache(Span** spans, size_t n);
+
+	//把空闲超过idle毫秒的span的物理内存和缓存的大对象映射还给系统，返回还回去的字节数
+	size_t Scavenge(size_t idle);
+	//立刻把至少bytes字节的空闲页还给系统(不够就全部还回去)，返回实际还回去的字节数
+	size_t ReleaseToSystem(size_t bytes);
+
+	//填写PageCache中空闲span的统计和锁竞争次数
+	void GetStats(AllocatorStats& stats);
+
+	//启动后台回收线程，每period毫秒把空闲超过idle毫秒的span还给系统
+	void StartScavenger(size_t period, size_t idle);
+	void StopScavenger();
 
 	//析构函数
 	~PageCache();
 private:
-	SpanList _spanlist[NPAGES];
-	std::unordered_map<PageID, Span*> _idspanmap;
-	std::mutex _mutex;
+	//每个分片有自己的空闲span链表、锁和span对象池，不同CPU上的线程互不竞争
+	//分片的页来自SystemAllocator中它自己的区域，所以合并只会发生在分片内部
+	struct Shard
+	{
+		SpanList _spanlist[NPAGES];
+		std::mutex _mutex;
+		ObjectPool<Span> _spanpool; //span对象池，在_mutex下使用
+	};
+
+	Shard _shards[NSHARDS];
+	PageMap _idspanmap; //页号到span的映射，读不加锁，Set在页所属分片的锁下
+	std::mutex _mapmutex; //Ensure会分配共享的中间节点，不同分片之间需要互斥
+	StatCounter _waits; //分片锁的竞争次数
+	StatCounter _spanbytes; //从系统拿来切span的字节数
+
+	//后台回收线程
+	std::thread _scavenger;
+	std::mutex _scavmutex;
+	std::condition_variable _scavcond;
+	bool _scavstop = false;
 private:
+	Span* _NewSpan(Shard& shard, size_t index, size_t n);
+	void _ReleaseSpan(Shard& shard, Span* span);
+	bool _GrowSpan(Span* span, size_t npage);
+	bool _ResizeHuge(Span* span, size_t npage);
+	bool _EnsureMap(PageID start, size_t n);
+	size_t _ReleaseSpans(Shard& shard, size_t bytes, size_t idle);
+	size_t _ReleaseHugePage(Shard& shard, Span* span, size_t now, size_t idle);
+	//把空闲的span切成前n页和剩下的两个空闲span，_released和_freetime不变
+	void _SplitFreeSpan(Shard& shard, Span* span, size_t n);
+
 	PageCache(){}
 	PageCache(const PageCache&) = delete;
-	static PageCache _inst;
 };
\ No newline at end of file
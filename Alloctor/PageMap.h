@@ -0,0 +1,159 @@
+#pragma once
+
+#include "Common.h"
+
+//页号到Span的映射，使用基数树实现(参考tcmalloc的PageMap)
+//读操作不加锁，只有两三次依赖的访存，没有哈希计算
+//写操作由调用者加锁：Set在页所属分片的锁下，Ensure在PageCache::_mapmutex下
+//节点一旦分配就不会释放，所以并发读时看到的节点指针总是有效的
+
+//两层基数树，适用于32位地址空间
+template <int BITS>
+class PageMap2
+{
+private:
+	static const int ROOT_BITS = 5;
+	static const int ROOT_LENGTH = 1 << ROOT_BITS;
+	static const int LEAF_BITS = BITS - ROOT_BITS;
+	static const int LEAF_LENGTH = 1 << LEAF_BITS;
+
+	struct Leaf
+	{
+		Span* values[LEAF_LENGTH];
+	};
+
+	Leaf* _root[ROOT_LENGTH] = {}; //根节点直接放在对象里
+
+public:
+	Span* Get(PageID k) const
+	{
+		const size_t i1 = (size_t)k >> LEAF_BITS;
+		const size_t i2 = (size_t)k & (LEAF_LENGTH - 1);
+		if (((size_t)k >> BITS) > 0 || _root[i1] == nullptr)
+			return nullptr;
+		return _root[i1]->values[i2];
+	}
+
+	//调用前必须先Ensure
+	void Set(PageID k, Span* v)
+	{
+		const size_t i1 = (size_t)k >> LEAF_BITS;
+		const size_t i2 = (size_t)k & (LEAF_LENGTH - 1);
+		_root[i1]->values[i2] = v;
+	}
+
+	//提前分配好[start, start+n)所需的叶子节点
+	bool Ensure(PageID start, size_t n)
+	{
+		for (size_t key = (size_t)start; key <= (size_t)start + n - 1;)
+		{
+			const size_t i1 = key >> LEAF_BITS;
+			if (i1 >= ROOT_LENGTH)
+				return false;
+
+			if (_root[i1] == nullptr)
+			{
+				Leaf* leaf = (Leaf*)SystemAlloc((sizeof(Leaf) + (1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT);
+				if (leaf == nullptr)
+					return false;
+				memset(leaf, 0, sizeof(*leaf));
+				_root[i1] = leaf;
+			}
+
+			//跳到下一个叶子节点覆盖的范围
+			key = ((key >> LEAF_BITS) + 1) << LEAF_BITS;
+		}
+		return true;
+	}
+};
+
+//三层基数树，适用于64位地址空间
+template <int BITS>
+class PageMap3
+{
+private:
+	static const int INTERIOR_BITS = (BITS + 2) / 3; //向上取整
+	static const int INTERIOR_LENGTH = 1 << INTERIOR_BITS;
+	static const int LEAF_BITS = BITS - 2 * INTERIOR_BITS;
+	static const int LEAF_LENGTH = 1 << LEAF_BITS;
+
+	struct Node
+	{
+		Node* ptrs[INTERIOR_LENGTH];
+	};
+
+	struct Leaf
+	{
+		Span* values[LEAF_LENGTH];
+	};
+
+	Node* _root[INTERIOR_LENGTH] = {}; //根节点直接放在对象里
+
+	template <class T>
+	static T* NewNode()
+	{
+		T* node = (T*)SystemAlloc((sizeof(T) + (1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT);
+		if (node != nullptr)
+			memset(node, 0, sizeof(T));
+		return node;
+	}
+
+public:
+	Span* Get(PageID k) const
+	{
+		const size_t i1 = (size_t)k >> (LEAF_BITS + INTERIOR_BITS);
+		const size_t i2 = ((size_t)k >> LEAF_BITS) & (INTERIOR_LENGTH - 1);
+		const size_t i3 = (size_t)k & (LEAF_LENGTH - 1);
+		if (((size_t)k >> BITS) > 0 || _root[i1] == nullptr || _root[i1]->ptrs[i2] == nullptr)
+			return nullptr;
+		return reinterpret_cast<Leaf*>(_root[i1]->ptrs[i2])->values[i3];
+	}
+
+	//调用前必须先Ensure
+	void Set(PageID k, Span* v)
+	{
+		const size_t i1 = (size_t)k >> (LEAF_BITS + INTERIOR_BITS);
+		const size_t i2 = ((size_t)k >> LEAF_BITS) & (INTERIOR_LENGTH - 1);
+		const size_t i3 = (size_t)k & (LEAF_LENGTH - 1);
+		reinterpret_cast<Leaf*>(_root[i1]->ptrs[i2])->values[i3] = v;
+	}
+
+	//提前分配好[start, start+n)所需的中间节点和叶子节点
+	bool Ensure(PageID start, size_t n)
+	{
+		for (size_t key = (size_t)start; key <= (size_t)start + n - 1;)
+		{
+			const size_t i1 = key >> (LEAF_BITS + INTERIOR_BITS);
+			const size_t i2 = (key >> LEAF_BITS) & (INTERIOR_LENGTH - 1);
+			if (i1 >= INTERIOR_LENGTH)
+				return false;
+
+			if (_root[i1] == nullptr)
+			{
+				Node* node = NewNode<Node>();
+				if (node == nullptr)
+					return false;
+				_root[i1] = node;
+			}
+
+			if (_root[i1]->ptrs[i2] == nullptr)
+			{
+				Leaf* leaf = NewNode<Leaf>();
+				if (leaf == nullptr)
+					return false;
+				_root[i1]->ptrs[i2] = reinterpret_cast<Node*>(leaf);
+			}
+
+			//跳到下一个叶子节点覆盖的范围
+			key = ((key >> LEAF_BITS) + 1) << LEAF_BITS;
+		}
+		return true;
+	}
+};
+
+//64位下用户态地址一般只有48位
+#if defined(_WIN64) || defined(__x86_64__) || defined(__aarch64__) || defined(__LP64__)
+typedef PageMap3<48 - PAGE_SHIFT> PageMap;
+#else
+typedef PageMap2<32 - PAGE_SHIFT> PageMap;
+#endif
@@ -0,0 +1,266 @@
+#include "Common.h"
+#include "ConcurrentAlloc.h"
+#include "TraceRecorder.h"
+#include <chrono>
+#include <fstream>
+#include <map>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+// 回放TraceRecorder记录的trace
+// 用法：replay [-m pool|malloc] [-1] [-d] [-v] trace文件
+//   -m  回放到哪个分配器，默认pool(ConcurrentAlloc)
+//   -1  单线程按时间顺序回放(结果可以重复)，默认每个原始线程一个回放线程
+//   -d  不回放，只输出大小分布("大小 次数"，可以直接给benchmark -s用)
+//   -v  回放结束后输出分配器的统计
+//
+// 回放前按时间把所有记录排好序，把地址换成对象编号(同一个地址被复用时是不同的对象)，
+// 跨线程释放的对象要等申请它的线程回放到那里之后才能释放
+
+struct Event
+{
+	unsigned long long _time;
+	unsigned int _tid;
+	unsigned char _op;
+	size_t _addr; //对象地址/8，排序后换成对象编号
+	size_t _size;
+};
+
+static bool GetVarint(const unsigned char*& p, const unsigned char* end, unsigned long long& v)
+{
+	v = 0;
+	for (int shift = 0; p < end && shift < 64; shift += 7)
+	{
+		unsigned char byte = *p++;
+		v |= (unsigned long long)(byte & 0x7f) << shift;
+		if ((byte & 0x80) == 0)
+			return true;
+	}
+	return false;
+}
+
+static bool LoadTrace(const char* path, std::vector<Event>& events)
+{
+	std::ifstream in(path, std::ios::binary);
+	char magic[sizeof(TRACE_MAGIC)];
+	if (!in.read(magic, sizeof(magic)) || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0)
+		return false;
+
+	std::vector<unsigned char> data;
+	for (;;)
+	{
+		unsigned int header[2];
+		unsigned long long base;
+		if (!in.read((char*)header, sizeof(header)) || !in.read((char*)&base, sizeof(base)))
+			break;
+		data.resize(header[1]);
+		if (!in.read((char*)data.data(), data.size()))
+			return false;
+
+		const unsigned char* p = data.data();
+		const unsigned char* end = p + data.size();
+		unsigned long long time = base;
+		size_t addr = 0;
+		while (p < end)
+		{
+			Event ev;
+			ev._tid = header[0];
+			ev._op = *p++;
+			unsigned long long delta, zigzag, size = 0;
+			if (!GetVarint(p, end, delta) || !GetVarint(p, end, zigzag))
+				return false;
+			if (ev._op == TRACE_ALLOC && !GetVarint(p, end, size))
+				return false;
+
+			time += delta;
+			addr += (size_t)((zigzag >> 1) ^ (~(zigzag & 1) + 1));
+			ev._time = time;
+			ev._addr = addr;
+			ev._size = (size_t)size;
+			events.push_back(ev);
+		}
+	}
+	return true;
+}
+
+// 按时间排序，地址换成对象编号，返回对象个数
+// 找不到对应申请的释放(开始记录之前申请的对象)直接丢掉
+static size_t AssignIds(std::vector<Event>& events, std::vector<size_t>& sizes)
+{
+	std::stable_sort(events.begin(), events.end(), [](const Event& a, const Event& b) {
+		return a._time < b._time;
+	});
+
+	std::unordered_map<size_t, size_t> live;
+	size_t n = 0;
+	for (size_t i = 0; i < events.size(); ++i)
+	{
+		Event ev = events[i];
+		if (ev._op == TRACE_ALLOC)
+		{
+			live[ev._addr] = sizes.size();
+			ev._addr = sizes.size();
+			sizes.push_back(ev._size);
+		}
+		else
+		{
+			auto it = live.find(ev._addr);
+			if (it == live.end())
+				continue;
+			ev._addr = it->second;
+			ev._size = sizes[it->second];
+			live.erase(it);
+		}
+		events[n++] = ev;
+	}
+	events.resize(n);
+	return sizes.size();
+}
+
+struct PoolApi
+{
+	static void* Alloc(size_t size) { return ConcurrentAlloc(size); }
+	static void Free(void* ptr, size_t size) { ConcurrentFree(ptr, size); }
+};
+
+struct MallocApi
+{
+	static void* Alloc(size_t size) { return malloc(size); }
+	static void Free(void* ptr, size_t) { free(ptr); }
+};
+
+template <class Api>
+static void ReplayEvents(const std::vector<Event>& events, std::vector<std::atomic<void*> >& objs,
+	const std::vector<size_t>& sizes)
+{
+	for (const Event& ev : events)
+	{
+		if (ev._op == TRACE_ALLOC)
+		{
+			void* ptr = Api::Alloc(ev._size == 0 ? 1 : ev._size);
+			objs[ev._addr].store(ptr, std::memory_order_release);
+		}
+		else
+		{
+			//对象是别的线程申请的，等它先回放到申请的位置
+			void* ptr;
+			while ((ptr = objs[ev._addr].exchange(nullptr, std::memory_order_acquire)) == nullptr)
+				std::this_thread::yield();
+			Api::Free(ptr, sizes[ev._addr] == 0 ? 1 : sizes[ev._addr]);
+		}
+	}
+}
+
+template <class Api>
+static double Replay(const std::vector<Event>& events, size_t nobjs, const std::vector<size_t>& sizes, bool single)
+{
+	std::vector<std::atomic<void*> > objs(nobjs);
+	for (auto& obj : objs)
+		obj.store(nullptr, std::memory_order_relaxed);
+
+	std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+	if (single)
+	{
+		ReplayEvents<Api>(events, objs, sizes);
+	}
+	else
+	{
+		//按原始线程分组，组内保持时间顺序
+		std::map<unsigned int, std::vector<Event> > bythread;
+		for (const Event& ev : events)
+			bythread[ev._tid].push_back(ev);
+
+		std::vector<std::thread> threads;
+		for (auto& group : bythread)
+		{
+			const std::vector<Event>* list = &group.second;
+			threads.push_back(std::thread([list, &objs, &sizes]() {
+				ReplayEvents<Api>(*list, objs, sizes);
+			}));
+		}
+		for (auto& t : threads)
+			t.join();
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+	//trace结束时还活着的对象
+	for (size_t i = 0; i < nobjs; ++i)
+	{
+		void* ptr = objs[i].load(std::memory_order_relaxed);
+		if (ptr != nullptr)
+			Api::Free(ptr, sizes[i] == 0 ? 1 : sizes[i]);
+	}
+	return seconds;
+}
+
+static size_t PeakRssKb()
+{
+#ifdef _WIN32
+	return 0;
+#else
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return (size_t)usage.ru_maxrss;
+#endif
+}
+
+int main(int argc, char* argv[])
+{
+	const char* path = nullptr;
+	bool usemalloc = false, single = false, dist = false, verbose = false;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+			usemalloc = strcmp(argv[++i], "malloc") == 0;
+		else if (strcmp(argv[i], "-1") == 0)
+			single = true;
+		else if (strcmp(argv[i], "-d") == 0)
+			dist = true;
+		else if (strcmp(argv[i], "-v") == 0)
+			verbose = true;
+		else
+			path = argv[i];
+	}
+	if (path == nullptr)
+	{
+		fprintf(stderr, "usage: %s [-m pool|malloc] [-1] [-d] [-v] trace\n", argv[0]);
+		return 1;
+	}
+
+	std::vector<Event> events;
+	if (!LoadTrace(path, events))
+	{
+		fprintf(stderr, "cannot read trace %s\n", path);
+		return 1;
+	}
+
+	if (dist)
+	{
+		std::map<size_t, size_t> hist;
+		for (const Event& ev : events)
+			if (ev._op == TRACE_ALLOC)
+				++hist[ev._size];
+		for (auto& kv : hist)
+			printf("%zu %zu\n", kv.first, kv.second);
+		return 0;
+	}
+
+	std::vector<size_t> sizes;
+	size_t nobjs = AssignIds(events, sizes);
+	std::map<unsigned int, size_t> threads;
+	for (const Event& ev : events)
+		++threads[ev._tid];
+
+	double seconds = usemalloc
+		? Replay<MallocApi>(events, nobjs, sizes, single)
+		: Replay<PoolApi>(events, nobjs, sizes, single);
+
+	printf("%s: %zu events, %zu objects, %zu threads%s\n", usemalloc ? "malloc" : "ConcurrentAlloc",
+		events.size(), nobjs, threads.size(), single ? " (replayed on one thread)" : "");
+	printf("time %.3f ms, %.2f Mops/s, peak rss %zu KiB\n", seconds * 1e3, events.size() / seconds / 1e6, PeakRssKb());
+	if (verbose && !usemalloc)
+		DumpStats(stdout);
+	return 0;
+}
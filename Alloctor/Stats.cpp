@@ -0,0 +1,143 @@
+#include "Stats.h"
+#include "CentralCache.h"
+#include "ThreadCache.h"
+#include "PageCache.h"
+#include "SystemAllocator.h"
+
+//所有还活着的ThreadCache的计数，双向链表
+//这些静态变量都是常量初始化的，替换系统malloc后在静态对象构造之前也能使用
+static std::mutex statsmutex;
+static CacheCounters* statshead = nullptr;
+static ClassCounters retired[NLISTS]; //已经销毁的ThreadCache累加到这里
+
+CacheCounters::CacheCounters()
+{
+	std::unique_lock<std::mutex> lock(statsmutex);
+	_next = statshead;
+	if (statshead != nullptr)
+		statshead->_prev = this;
+	statshead = this;
+}
+
+CacheCounters::~CacheCounters()
+{
+	std::unique_lock<std::mutex> lock(statsmutex);
+	for (size_t i = 0; i < NLISTS; ++i)
+	{
+		retired[i]._allocs.Add(_classes[i]._allocs.Get());
+		retired[i]._frees.Add(_classes[i]._frees.Get());
+		retired[i]._misses.Add(_classes[i]._misses.Get());
+		retired[i]._fetched.Add(_classes[i]._fetched.Get());
+		retired[i]._returned.Add(_classes[i]._returned.Get());
+	}
+
+	if (_prev != nullptr)
+		_prev->_next = _next;
+	else
+		statshead = _next;
+	if (_next != nullptr)
+		_next->_prev = _prev;
+}
+
+static void AddCounters(SizeClassStats& stats, const ClassCounters& counters)
+{
+	stats._allocs += counters._allocs.Get();
+	stats._frees += counters._frees.Get();
+	stats._misses += counters._misses.Get();
+	stats._fetched += counters._fetched.Get();
+	stats._returned += counters._returned.Get();
+}
+
+//各个计数不是同时读到的，差值可能暂时为负，按0处理
+static size_t Diff(size_t a, size_t b)
+{
+	return a > b ? a - b : 0;
+}
+
+AllocatorStats GetStats()
+{
+	AllocatorStats stats;
+	memset(&stats, 0, sizeof(stats));
+
+	{
+		std::unique_lock<std::mutex> lock(statsmutex);
+		for (size_t i = 0; i < NLISTS; ++i)
+			AddCounters(stats._classes[i], retired[i]);
+		for (CacheCounters* cur = statshead; cur != nullptr; cur = cur->_next)
+		{
+			++stats._threadcaches;
+			for (size_t i = 0; i < NLISTS; ++i)
+				AddCounters(stats._classes[i], cur->_classes[i]);
+		}
+	}
+
+	for (size_t i = 0; i < NLISTS; ++i)
+	{
+		SizeClassStats& cls = stats._classes[i];
+		cls._size = SizeClass::Size(i);
+		cls._hits = Diff(cls._allocs, cls._misses);
+		//从中心缓存拿来的和线程释放的，减去交给用户的和还回去的，就是还留在线程缓存里的
+		cls._threadcached = Diff(cls._fetched + cls._frees, cls._allocs + cls._returned);
+		CentralCache::Getinstence()->GetClassStats(i, cls);
+
+		stats._threadcachebytes += cls._threadcached * cls._size;
+		stats._transferbytes += cls._transfercached * cls._size;
+		stats._centralfreebytes += cls._centralfree * cls._size;
+		stats._wastebytes += cls._wastebytes;
+		stats._transferlockwaits += cls._transferwaits;
+	}
+
+	stats._threadcachebudget = ThreadCache::Budget();
+	stats._threadcacheunclaimed = ThreadCache::Unclaimed();
+
+	PageCache::GetInstence()->GetStats(stats);
+	stats._mappedbytes = SystemAllocator::GetInstence()->MappedBytes();
+	stats._hugebytes = SystemAllocator::GetInstence()->HugeBytes();
+
+	size_t cached = stats._pagefreebytes + stats._largecachebytes + stats._centralfreebytes + stats._wastebytes
+		+ stats._transferbytes + stats._threadcachebytes;
+	stats._inusebytes = Diff(stats._spanbytes + stats._hugebytes, cached);
+	return stats;
+}
+
+void DumpStats(FILE* out)
+{
+	AllocatorStats stats = GetStats();
+	const double MB = 1024.0 * 1024.0;
+
+	fprintf(out, "------------------------------------------------\n");
+	fprintf(out, "MALLOC: %12zu (%8.1f MiB) mapped from system\n", stats._mappedbytes, stats._mappedbytes / MB);
+	fprintf(out, "MALLOC: %12zu (%8.1f MiB) in use by application\n", stats._inusebytes, stats._inusebytes / MB);
+	fprintf(out, "MALLOC: %12zu (%8.1f MiB) huge objects\n", stats._hugebytes, stats._hugebytes / MB);
+	fprintf(out, "MALLOC: %12zu (%8.1f MiB) free in page cache (%zu spans)\n",
+		stats._pagefreebytes, stats._pagefreebytes / MB, stats._pagefreespans);
+	fprintf(out, "MALLOC: %12zu (%8.1f MiB) free in large object cache (%zu hits, %zu misses, %zu evictions)\n",
+		stats._largecachebytes, stats._largecachebytes / MB, stats._largecachehits, stats._largecachemisses,
+		stats._largecacheevictions);
+	fprintf(out, "MALLOC: %12zu (%8.1f MiB) released to system\n", stats._pagereleasedbytes, stats._pagereleasedbytes / MB);
+	fprintf(out, "MALLOC: %12zu (%8.1f MiB) free in central cache\n", stats._centralfreebytes, stats._centralfreebytes / MB);
+	fprintf(out, "MALLOC: %12zu (%8.1f MiB) span tail fragmentation\n", stats._wastebytes, stats._wastebytes / MB);
+	fprintf(out, "MALLOC: %12zu (%8.1f MiB) free in transfer cache\n", stats._transferbytes, stats._transferbytes / MB);
+	fprintf(out, "MALLOC: %12zu (%8.1f MiB) free in thread caches (%zu caches)\n",
+		stats._threadcachebytes, stats._threadcachebytes / MB, stats._threadcaches);
+	fprintf(out, "MALLOC: %12zu (%8.1f MiB) thread cache budget (%.1f MiB unclaimed)\n",
+		stats._threadcachebudget, stats._threadcachebudget / MB, stats._threadcacheunclaimed / MB);
+	fprintf(out, "MALLOC: %12zu (%8.1f MiB) metadata\n",
+		Diff(stats._mappedbytes, stats._spanbytes + stats._hugebytes), Diff(stats._mappedbytes, stats._spanbytes + stats._hugebytes) / MB);
+	fprintf(out, "MALLOC: %12zu page cache lock waits\n", stats._pagelockwaits);
+	fprintf(out, "MALLOC: %12zu transfer cache lock waits\n", stats._transferlockwaits);
+	fprintf(out, "------------------------------------------------\n");
+	fprintf(out, "%6s %12s %12s %8s %10s %10s %8s %8s %8s %8s\n",
+		"size", "allocs", "hits", "hit%", "misses", "avgfetch", "tcache", "spans", "cfree", "waits");
+	for (size_t i = 0; i < NLISTS; ++i)
+	{
+		const SizeClassStats& cls = stats._classes[i];
+		if (cls._allocs == 0 && cls._spans == 0)
+			continue;
+		fprintf(out, "%6zu %12zu %12zu %7.2f%% %10zu %10.1f %8zu %8zu %8zu %8zu\n",
+			cls._size, cls._allocs, cls._hits,
+			cls._allocs == 0 ? 0.0 : cls._hits * 100.0 / cls._allocs,
+			cls._misses, cls._misses == 0 ? 0.0 : (double)cls._fetched / cls._misses,
+			cls._threadcached, cls._spans, cls._centralfree, cls._lockwaits);
+	}
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include "Common.h"
+#include <stdio.h>
+
+//统计计数器，读的时候不加锁
+//Inc/IncLocal都是relaxed操作，不会带来额外的同步开销，线上可以一直打开
+class StatCounter
+{
+private:
+	std::atomic<size_t> _value;
+
+public:
+	constexpr StatCounter() : _value(0) {}
+
+	//多个线程会同时写的计数器(锁竞争次数、映射的字节数等)
+	void Add(size_t n)
+	{
+		_value.fetch_add(n, std::memory_order_relaxed);
+	}
+	void Sub(size_t n)
+	{
+		_value.fetch_sub(n, std::memory_order_relaxed);
+	}
+
+	//同一时刻只有一个线程写的计数器(ThreadCache自己的计数)，不需要原子的读改写
+	void AddLocal(size_t n)
+	{
+		_value.store(_value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+
+	size_t Get() const
+	{
+		return _value.load(std::memory_order_relaxed);
+	}
+};
+
+//先尝试加锁，失败说明有竞争，计数之后再阻塞等待
+//lock需要用std::defer_lock构造
+inline static void LockCounted(std::unique_lock<std::mutex>& lock, StatCounter& waits)
+{
+	if (!lock.try_lock())
+	{
+		waits.Add(1);
+		lock.lock();
+	}
+}
+
+//一个ThreadCache中一个自由链表位置的计数
+struct ClassCounters
+{
+	StatCounter _allocs; //申请次数
+	StatCounter _frees; //释放次数
+	StatCounter _misses; //自由链表为空，去中心缓存取的次数
+	StatCounter _fetched; //从中心缓存取到的对象个数
+	StatCounter _returned; //还给中心缓存的对象个数
+};
+
+//每个ThreadCache(包括CpuCache的每个槽位)自己的计数，创建时登记，销毁时累加到全局后注销
+//统计时把所有登记的计数加起来，热路径上只有relaxed的读和写
+struct CacheCounters
+{
+	ClassCounters _classes[NLISTS];
+	CacheCounters* _prev = nullptr;
+	CacheCounters* _next = nullptr;
+
+	CacheCounters();
+	~CacheCounters();
+
+	CacheCounters(const CacheCounters&) = delete;
+};
+
+//一个自由链表位置的统计结果
+struct SizeClassStats
+{
+	size_t _size; //对象大小
+	size_t _allocs; //申请次数
+	size_t _frees; //释放次数
+	size_t _hits; //直接在线程缓存中拿到的次数
+	size_t _misses; //去中心缓存取的次数
+	size_t _fetched; //从中心缓存取到的对象个数，除以_misses就是平均每次取的个数
+	size_t _returned; //还给中心缓存的对象个数
+	size_t _threadcached; //线程缓存中的对象个数
+	size_t _transfercached; //transfer cache中的对象个数
+	size_t _spans; //中心缓存中的span个数
+	size_t _centralfree; //中心缓存span中空闲的对象个数
+	size_t _wastebytes; //span末尾不够切一个对象的字节数
+	size_t _lockwaits; //中心缓存桶锁的竞争次数
+	size_t _transferwaits; //transfer cache自旋锁的竞争次数
+};
+
+struct AllocatorStats
+{
+	SizeClassStats _classes[NLISTS];
+
+	size_t _threadcaches; //正在使用的ThreadCache个数
+
+	size_t _mappedbytes; //向系统申请的字节数(包括元数据)
+	size_t _spanbytes; //交给PageCache做span的字节数
+	size_t _hugebytes; //超过128页、直接映射的大对象字节数
+	size_t _pagefreebytes; //PageCache中空闲span的字节数(包括已经还给系统的)
+	size_t _pagereleasedbytes; //其中已经还给系统、不占物理内存的字节数
+	size_t _pagefreespans; //PageCache中空闲span的个数
+	size_t _largecachebytes; //缓存的已释放大对象映射的字节数(算在_hugebytes里)
+	size_t _largecachehits; //大对象从缓存中拿到映射的次数
+	size_t _largecachemisses; //大对象缓存没有合适映射、向系统申请的次数
+	size_t _largecacheevictions; //因为超过上限、放得太久或者被回收还给系统的缓存映射个数
+	size_t _centralfreebytes; //中心缓存span中空闲对象的字节数
+	size_t _wastebytes; //中心缓存span末尾浪费的字节数
+	size_t _transferbytes; //transfer cache中对象的字节数
+	size_t _threadcachebytes; //线程缓存中对象的字节数
+	size_t _threadcachebudget; //所有线程缓存共享的预算
+	size_t _threadcacheunclaimed; //预算中还没有分给任何线程缓存的字节数
+	size_t _inusebytes; //用户正在使用的字节数(按对象大小取整后)
+
+	size_t _pagelockwaits; //PageCache分片锁的竞争次数
+	size_t _transferlockwaits; //transfer cache自旋锁的竞争次数
+};
+
+//汇总所有层的统计，各层分别加锁读取，结果不是同一时刻的快照
+AllocatorStats GetStats();
+
+//以可读的文本形式输出统计结果
+void DumpStats(FILE* out);
@@ -0,0 +1,178 @@
+#include "SystemAllocator.h"
+
+static bool ReadHugePages()
+{
+	const char* env = getenv("CONCURRENT_ALLOC_HUGEPAGE");
+	return env != nullptr && env[0] != '\0' && env[0] != '0';
+}
+
+std::atomic<bool> SystemAllocator::_hugepages(ReadHugePages());
+
+//告诉系统这段内存尽量用透明大页
+static void AdviseHugePages(void* ptr, size_t bytes)
+{
+#if defined(MADV_HUGEPAGE)
+	if (SystemAllocator::HugePages())
+		madvise(ptr, bytes, MADV_HUGEPAGE);
+#else
+	(void)ptr;
+	(void)bytes;
+#endif
+}
+
+//预留一段按REGION_ALIGN对齐的虚拟地址，此时还没有提交物理内存
+bool SystemAllocator::_Reserve(Region& region, size_t npage)
+{
+	//大小取REGION_ALIGN的整数倍，保证区域的尾部也落在对齐边界上
+	size_t size = ((npage << PAGE_SHIFT) + REGION_ALIGN - 1) & ~(REGION_ALIGN - 1);
+
+#ifdef _WIN32
+	//windows下无法只释放预留区域的一部分，多预留的头部只占用地址空间
+	char* ptr = (char*)VirtualAlloc(0, size + REGION_ALIGN, MEM_RESERVE, PAGE_NOACCESS);
+	if (ptr == nullptr)
+		return false;
+	char* aligned = (char*)(((size_t)ptr + REGION_ALIGN - 1) & ~(REGION_ALIGN - 1));
+#else
+	char* ptr = (char*)mmap(nullptr, size + REGION_ALIGN, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (ptr == MAP_FAILED)
+		return false;
+	char* aligned = (char*)(((size_t)ptr + REGION_ALIGN - 1) & ~(REGION_ALIGN - 1));
+
+	//把对齐多出来的头部和尾部还给系统
+	if (aligned != ptr)
+		munmap(ptr, aligned - ptr);
+	size_t tail = (ptr + size + REGION_ALIGN) - (aligned + size);
+	if (tail != 0)
+		munmap(aligned + size, tail);
+#endif
+
+	region._begin = aligned;
+	region._commit = aligned;
+	region._end = aligned + size;
+	return true;
+}
+
+void* SystemAllocator::AllocPages(size_t npage, size_t shard)
+{
+	assert(shard < NSHARDS);
+	std::unique_lock<std::mutex> lock(_mutex);
+	Region& region = _regions[shard];
+
+	size_t bytes = npage << PAGE_SHIFT;
+	if (region._begin == nullptr || region._begin + bytes > region._end)
+	{
+		//当前区域剩下的部分不够，直接换一段新的区域
+		if (!_Reserve(region, npage))
+			return nullptr;
+	}
+
+	//按块提交，减少系统调用的次数
+	if (region._begin + bytes > region._commit)
+	{
+		//按COMMIT_PAGES的整数倍提交，区域又是按REGION_ALIGN对齐的，所以提交的都是完整的大页
+		size_t need = region._begin + bytes - region._commit;
+		need = (need + (COMMIT_PAGES << PAGE_SHIFT) - 1) / (COMMIT_PAGES << PAGE_SHIFT) * (COMMIT_PAGES << PAGE_SHIFT);
+		if (need > (size_t)(region._end - region._commit))
+			need = region._end - region._commit;
+
+#ifdef _WIN32
+		if (VirtualAlloc(region._commit, need, MEM_COMMIT, PAGE_READWRITE) == nullptr)
+			return nullptr;
+#else
+		if (mprotect(region._commit, need, PROT_READ | PROT_WRITE) != 0)
+			return nullptr;
+		AdviseHugePages(region._commit, need);
+#endif
+		region._commit += need;
+		_mapped.Add(need);
+	}
+
+	void* ptr = region._begin;
+	region._begin += bytes;
+	return ptr;
+}
+
+void* SystemAllocator::AllocHuge(size_t npage)
+{
+	//mmap/VirtualAlloc返回的地址本身就是按页对齐的
+	void* ptr = SystemAlloc(npage);
+	if (ptr != nullptr)
+	{
+		AdviseHugePages(ptr, npage << PAGE_SHIFT);
+		_mapped.Add(npage << PAGE_SHIFT);
+		_huge.Add(npage << PAGE_SHIFT);
+	}
+	return ptr;
+}
+
+void SystemAllocator::Release(void* ptr, size_t npage)
+{
+#ifdef _WIN32
+	VirtualAlloc(ptr, npage << PAGE_SHIFT, MEM_RESET, PAGE_READWRITE);
+#else
+	madvise(ptr, npage << PAGE_SHIFT, MADV_DONTNEED);
+#endif
+}
+
+void SystemAllocator::FreeHuge(void* ptr, size_t npage)
+{
+	_mapped.Sub(npage << PAGE_SHIFT);
+	_huge.Sub(npage << PAGE_SHIFT);
+#ifdef _WIN32
+	(void)npage;
+	VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+	munmap(ptr, npage << PAGE_SHIFT);
+#endif
+}
+
+void* SystemAllocator::ResizeHuge(void* ptr, size_t npage, size_t newnpage, void* dest)
+{
+#ifdef _WIN32
+	(void)ptr;
+	(void)npage;
+	(void)newnpage;
+	(void)dest;
+	return nullptr;
+#else
+	//mremap只修改页表，不拷贝数据；搬家时直接替换掉dest上预留的映射
+	void* newptr = dest == nullptr
+		? mremap(ptr, npage << PAGE_SHIFT, newnpage << PAGE_SHIFT, 0)
+		: mremap(ptr, npage << PAGE_SHIFT, newnpage << PAGE_SHIFT, MREMAP_MAYMOVE | MREMAP_FIXED, dest);
+	if (newptr == MAP_FAILED)
+		return nullptr;
+
+	if (newnpage > npage)
+	{
+		_mapped.Add((newnpage - npage) << PAGE_SHIFT);
+		_huge.Add((newnpage - npage) << PAGE_SHIFT);
+	}
+	else
+	{
+		_mapped.Sub((npage - newnpage) << PAGE_SHIFT);
+		_huge.Sub((npage - newnpage) << PAGE_SHIFT);
+	}
+	return newptr;
+#endif
+}
+
+void* SystemAllocator::ReserveHuge(size_t npage)
+{
+#ifdef _WIN32
+	(void)npage;
+	return nullptr;
+#else
+	void* ptr = mmap(nullptr, npage << PAGE_SHIFT, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	return ptr == MAP_FAILED ? nullptr : ptr;
+#endif
+}
+
+void SystemAllocator::UnreserveHuge(void* ptr, size_t npage)
+{
+#ifdef _WIN32
+	(void)ptr;
+	(void)npage;
+#else
+	munmap(ptr, npage << PAGE_SHIFT);
+#endif
+}
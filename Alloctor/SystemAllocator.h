@@ -0,0 +1,95 @@
+#pragma once
+
+#include "Common.h"
+#include "Stats.h"
+
+const size_t REGION_SHIFT = sizeof(void*) == 8 ? 30 : 24; //每次预留1G的虚拟地址(32位下16M)
+const size_t REGION_ALIGN = (size_t)1 << REGION_SHIFT; //区域按自身大小对齐，同一个对齐块里的页一定属于同一个区域
+const size_t COMMIT_PAGES = 4 * (NPAGES - 1); //每次提交的页数
+const size_t HUGEPAGE_SHIFT = 21; //透明大页2M
+const size_t HUGEPAGE_PAGES = (size_t)1 << (HUGEPAGE_SHIFT - PAGE_SHIFT); //一个大页包含的页数
+static_assert(COMMIT_PAGES % HUGEPAGE_PAGES == 0, "commits must cover whole huge pages");
+
+//向系统申请页的一层，PageCache的所有内存都从这里来，不再经过malloc
+//一次预留一大段按REGION_ALIGN对齐的虚拟地址，需要时再按块提交，
+//所以交出去的内存一定是按页对齐的，span不会再和相邻的页重叠
+//PageCache的每个分片使用自己的区域，合并span时不会碰到别的分片的页
+//单例模式
+class SystemAllocator
+{
+public:
+	static SystemAllocator* GetInstence()
+	{
+		//第一次使用时在静态存储上构造，并且永远不析构，
+		//替换系统malloc后可能在静态对象构造之前或者析构之后被调用
+		static std::aligned_storage<sizeof(SystemAllocator), alignof(SystemAllocator)>::type storage;
+		static SystemAllocator* inst = new(&storage) SystemAllocator;
+		return inst;
+	}
+
+	//从shard分片的预留区域中切出npage页已提交的内存，PageCache补充span时使用
+	void* AllocPages(size_t npage, size_t shard = 0);
+
+	//向系统提交的字节数(包括直接映射的大对象)和其中直接映射的大对象字节数
+	size_t MappedBytes() const
+	{
+		return _mapped.Get();
+	}
+	size_t HugeBytes() const
+	{
+		return _huge.Get();
+	}
+
+	//两个页是否在同一个预留区域中
+	static bool SameRegion(PageID a, PageID b)
+	{
+		return (a >> (REGION_SHIFT - PAGE_SHIFT)) == (b >> (REGION_SHIFT - PAGE_SHIFT));
+	}
+
+	//超过128页的大对象，直接单独映射，释放时直接还给系统
+	void* AllocHuge(size_t npage);
+	void FreeHuge(void* ptr, size_t npage);
+	//把直接映射的大对象改成newnpage页，内容保留；dest为nullptr时只在原地改，
+	//否则搬到dest(ReserveHuge预留的newnpage页)上；系统不支持或者失败时返回nullptr
+	void* ResizeHuge(void* ptr, size_t npage, size_t newnpage, void* dest = nullptr);
+	//预留npage页地址给ResizeHuge搬家用，不提交内存；没用上的用UnreserveHuge还回去
+	void* ReserveHuge(size_t npage);
+	void UnreserveHuge(void* ptr, size_t npage);
+
+	//把空闲页的物理内存还给系统，地址仍然保留，再次访问时由系统重新分配零页
+	void Release(void* ptr, size_t npage);
+
+	//是否用透明大页(MADV_HUGEPAGE)提交内存，设置环境变量CONCURRENT_ALLOC_HUGEPAGE=1打开
+	//打开后PageCache只把整个空闲的大页还给系统，不会把还在用的大页拆散
+	static bool HugePages()
+	{
+		return _hugepages.load(std::memory_order_relaxed);
+	}
+	//只影响之后提交的内存
+	static void SetHugePages(bool enabled)
+	{
+		_hugepages.store(enabled, std::memory_order_relaxed);
+	}
+
+private:
+	struct Region
+	{
+		char* _begin = nullptr; //当前区域的下一块可用地址
+		char* _commit = nullptr; //当前区域已经提交到哪里
+		char* _end = nullptr; //当前区域的结束地址
+	};
+
+	//给region预留一段新的区域
+	bool _Reserve(Region& region, size_t npage);
+
+	Region _regions[NSHARDS];
+	std::mutex _mutex;
+	StatCounter _mapped;
+	StatCounter _huge;
+
+	static std::atomic<bool> _hugepages;
+
+private:
+	SystemAllocator(){}
+	SystemAllocator(const SystemAllocator&) = delete;
+};
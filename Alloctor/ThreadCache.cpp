@@ -1,5 +1,148 @@
 #include "ThreadCache.h"
 #include "CentralCache.h"
+#include "ObjectPool.h"
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+thread_local ThreadCache* tlslist = nullptr;
+static thread_local bool tlsexited = false; //当前线程的ThreadCache是否已经销毁
+
+//ThreadCache对象也从对象池中拿，替换系统malloc时不会在创建过程中又递归进入malloc
+static ObjectPool<ThreadCache> tcpool;
+static std::mutex tcpoolmutex;
+
+static void DestroyThreadCache(void* ptr)
+{
+	tlslist = nullptr;
+	tlsexited = true;
+
+	//析构时会把对象还给中心缓存，不需要持有对象池的锁
+	ThreadCache* cache = (ThreadCache*)ptr;
+	cache->~ThreadCache();
+	std::unique_lock<std::mutex> lock(tcpoolmutex);
+	tcpool.Release(cache);
+}
+
+#ifdef _WIN32
+//windows下借助thread_local对象的析构函数在线程退出时回收
+struct ThreadCacheHolder
+{
+	ThreadCache* _cache = nullptr;
+
+	~ThreadCacheHolder()
+	{
+		if (_cache != nullptr)
+			DestroyThreadCache(_cache);
+	}
+};
+static thread_local ThreadCacheHolder tlsholder;
+#else
+//用pthread key的析构函数回收，注册时不会像thread_local析构函数那样去申请内存
+static pthread_key_t tlskey;
+static pthread_once_t tlsonce = PTHREAD_ONCE_INIT;
+
+static void CreateThreadCacheKey()
+{
+	pthread_key_create(&tlskey, DestroyThreadCache);
+}
+#endif
+
+ThreadCache* CreateThreadCache()
+{
+	if (tlsexited)
+		return nullptr;
+
+	ThreadCache* cache = nullptr;
+	{
+		std::unique_lock<std::mutex> lock(tcpoolmutex);
+		cache = tcpool.New();
+	}
+
+	//先设置tlslist，pthread_setspecific内部申请内存时就能直接用这个ThreadCache
+	tlslist = cache;
+#ifdef _WIN32
+	tlsholder._cache = cache;
+#else
+	pthread_once(&tlsonce, CreateThreadCacheKey);
+	pthread_setspecific(tlskey, cache);
+#endif
+	return cache;
+}
+
+//所有线程缓存共享的预算，可以是负数(每个缓存至少有MIN_THREAD_CACHE，缓存多的时候会超支)
+static std::atomic<size_t> cachebudget(THREAD_CACHE_BUDGET);
+static std::atomic<long long> unclaimed((long long)THREAD_CACHE_BUDGET);
+
+//所有线程缓存(包括CpuCache的槽位)的链表，偷预算时从stealcursor开始轮流找
+static std::mutex cachelistmutex;
+static ThreadCache* cachelist = nullptr;
+static ThreadCache* stealcursor = nullptr;
+static const size_t STEAL_TRIES = 10;
+
+ThreadCache::ThreadCache()
+	:_maxbytes(MIN_THREAD_CACHE)
+{
+	unclaimed.fetch_sub((long long)MIN_THREAD_CACHE, std::memory_order_relaxed);
+
+	std::unique_lock<std::mutex> lock(cachelistmutex);
+	_nextcache = cachelist;
+	if (cachelist != nullptr)
+		cachelist->_prevcache = this;
+	cachelist = this;
+}
+
+ThreadCache::~ThreadCache()
+{
+	for (size_t i = 0; i < NLISTS; ++i)
+	{
+		if (!_freelist[i].Empty())
+		{
+			_stats._classes[i]._returned.AddLocal(_freelist[i].Size());
+			CentralCache::Getinstence()->ReleaseListToSpans(_freelist[i].PopRange(), SizeClass::Size(i));
+		}
+	}
+
+	std::unique_lock<std::mutex> lock(cachelistmutex);
+	if (_prevcache != nullptr)
+		_prevcache->_nextcache = _nextcache;
+	else
+		cachelist = _nextcache;
+	if (_nextcache != nullptr)
+		_nextcache->_prevcache = _prevcache;
+	if (stealcursor == this)
+		stealcursor = _nextcache;
+	unclaimed.fetch_add((long long)_maxbytes.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+void ThreadCache::SetBudget(size_t bytes)
+{
+	size_t old = cachebudget.exchange(bytes, std::memory_order_relaxed);
+	unclaimed.fetch_add((long long)bytes - (long long)old, std::memory_order_relaxed);
+}
+
+size_t ThreadCache::Budget()
+{
+	return cachebudget.load(std::memory_order_relaxed);
+}
+
+size_t ThreadCache::Unclaimed()
+{
+	long long left = unclaimed.load(std::memory_order_relaxed);
+	return left > 0 ? (size_t)left : 0;
+}
+
+static bool ReadBudget()
+{
+	const char* env = getenv("CONCURRENT_ALLOC_THREAD_CACHE_BYTES");
+	if (env == nullptr || env[0] == '\0')
+		return false;
+	ThreadCache::SetBudget((size_t)strtoull(env, nullptr, 10));
+	return true;
+}
+
+static bool budgetfromenv = ReadBudget();
 
 
 //从中心缓存获取对象
@@ -14,7 +157,8 @@ void* ThreadCache::FetchFromCentralCache(size_t index, size_t size)
 	// 申请次数越多，数量多
 	// 次数少,数量少--->动态计算的结果
 	size_t maxsize = freelist->MaxSize();
-	size_t numtomove = SizeClass::NumMoveSize(size) < maxsize ? SizeClass::NumMoveSize(size) : maxsize;
+	size_t nummove = SizeClass::ClassNumMove(index);
+	size_t numtomove = nummove < maxsize ? nummove : maxsize;
 
 	void* start = nullptr, *end = nullptr;
 	// start，end分别表示取出来的内存的开始地址和结束地址
@@ -23,58 +167,221 @@ void* ThreadCache::FetchFromCentralCache(size_t index, size_t size)
 	// batchsize表示实际取出来的内存的个数
 	// batchsize有可能小于num，表示中心缓存没有那么多大小的内存块
 	size_t batchsize = CentralCache::Getinstence()->FetchRangeObj(start, end, numtomove, size);
+	_stats._classes[index]._misses.AddLocal(1);
+	_stats._classes[index]._fetched.AddLocal(batchsize);
 
 	if (batchsize > 1)
 	{
 		freelist->PushRange(NEXT_OBJ(start), end, batchsize - 1);//将多余的存起来
+		_bytes += (batchsize - 1) * size;
 	}
 
-	if (batchsize >= freelist->MaxSize())//只有等于的时候才会更新
+	_GrowMaxSize(freelist, nummove, batchsize);
+	return start;
+}
+
+void ThreadCache::_GrowMaxSize(Freelist* freelist, size_t nummove, size_t batchsize)
+{
+	// 上限小于一个批量时每次加1(慢启动)，之后每次加一个批量，
+	// 缓存的总字节数由预算控制，用不到的部分在ListTooLong和Scavenge中再缩回去
+	size_t maxsize = freelist->MaxSize();
+	if (maxsize < nummove)
 	{
-		freelist->SetMaxSize(maxsize + 1);//看不懂 maxsize>=numtomove>=batchsize
+		if (batchsize >= maxsize)
+			freelist->SetMaxSize(maxsize + 1);
+	}
+	else if (maxsize < MAX_FREELIST_LENGTH)
+	{
+		size_t newmax = maxsize + nummove;
+		freelist->SetMaxSize(newmax < MAX_FREELIST_LENGTH ? newmax : MAX_FREELIST_LENGTH);
 	}
-
-	return start;
 }
 
 //释放对象时，链表过长时，回收内存回到中心缓存
 void ThreadCache::ListTooLong(Freelist* freelist, size_t size)
 {
-	void* start = freelist->PopRange();
-	CentralCache::Getinstence()->ReleaseListToSpans(start, size);
+	size_t index = SizeClass::Index(size);
+	size_t nummove = SizeClass::ClassNumMove(index);
+
+	// 一次还一个批量，剩下的留给后面的申请
+	_ReleaseToCentral(freelist, index, size, freelist->Size() < nummove ? freelist->Size() : nummove);
+
+	// 释放这边也做慢增长，只释放不申请的线程(生产者消费者模型中的消费者)
+	// 否则每次释放都要去中心缓存加锁
+	if (freelist->MaxSize() < nummove)
+	{
+		freelist->SetMaxSize(freelist->MaxSize() + 1);
+	}
+	else if (freelist->MaxSize() > nummove)
+	{
+		// 上限比一个批量大，链表却一再超过上限，说明释放的比申请的多，缓存这么多没有用
+		freelist->SetOverages(freelist->Overages() + 1);
+		if (freelist->Overages() > MAX_OVERAGES)
+		{
+			freelist->SetMaxSize(freelist->MaxSize() - nummove);
+			freelist->SetOverages(0);
+		}
+	}
 }
 
-//申请和释放内存对象
-void* ThreadCache::Allocate(size_t size)
+void ThreadCache::_ReleaseToCentral(Freelist* freelist, size_t index, size_t size, size_t n)
 {
-	size_t index = SizeClass::Index(size);//获取到相对应的位置
-	Freelist* freelist = &_freelist[index];
-	if (!freelist->Empty())//在ThreadCache处不为空的话，直接取
+	if (n == 0)
+		return;
+
+	void* start = nullptr, *end = nullptr;
+	if (n == freelist->Size())
+		freelist->PopRange(start, end);
+	else
+		freelist->PopRange(start, end, n);
+	_bytes -= n * size;
+	_stats._classes[index]._returned.AddLocal(n);
+	CentralCache::Getinstence()->ReleaseRangeObj(start, end, n, size);
+}
+
+void ThreadCache::Scavenge()
+{
+	for (size_t i = 0; i < NLISTS; ++i)
+	{
+		Freelist* freelist = &_freelist[i];
+		size_t lowwater = freelist->LowWater();
+		if (lowwater > 0)
+		{
+			// 低水位以下的对象从上次回收到现在一直没用到，还回去一半
+			_ReleaseToCentral(freelist, i, SizeClass::Size(i), lowwater > 1 ? lowwater / 2 : 1);
+
+			size_t nummove = SizeClass::ClassNumMove(i);
+			if (freelist->MaxSize() > nummove)
+			{
+				size_t newmax = freelist->MaxSize() - nummove;
+				freelist->SetMaxSize(newmax > nummove ? newmax : nummove);
+			}
+		}
+		freelist->ClearLowWater();
+	}
+}
+
+void ThreadCache::OverLimit(size_t bytes)
+{
+	// 上次扩大上限失败了，攒够SCAVENGE_BYTES再来，偷不到的时候不会每次释放都扫链表、加全局锁
+	if (_overbytes > 0)
+	{
+		_overbytes += bytes;
+		if (_overbytes < SCAVENGE_BYTES)
+			return;
+		_overbytes = 0;
+	}
+
+	Scavenge();
+	if (!_IncreaseLimit())
+		_overbytes = bytes;
+}
+
+bool ThreadCache::_IncreaseLimit()
+{
+	// 先从还没分出去的预算里拿
+	long long left = unclaimed.load(std::memory_order_relaxed);
+	while (left >= (long long)STEAL_BYTES)
 	{
-		return freelist->Pop();
+		if (unclaimed.compare_exchange_weak(left, left - (long long)STEAL_BYTES, std::memory_order_relaxed))
+		{
+			_maxbytes.fetch_add(STEAL_BYTES, std::memory_order_relaxed);
+			return true;
+		}
 	}
+
+	// 预算分完了，轮流从其他缓存偷，被偷的缓存下次超过上限时自己回收
+	std::unique_lock<std::mutex> lock(cachelistmutex);
+	for (size_t i = 0; i < STEAL_TRIES; ++i)
+	{
+		if (stealcursor == nullptr)
+			stealcursor = cachelist;
+		ThreadCache* victim = stealcursor;
+		stealcursor = victim->_nextcache;
+		if (victim == this)
+			continue;
+
+		if (victim->_maxbytes.load(std::memory_order_relaxed) > MIN_THREAD_CACHE)
+		{
+			victim->_maxbytes.fetch_sub(STEAL_BYTES, std::memory_order_relaxed);
+			_maxbytes.fetch_add(STEAL_BYTES, std::memory_order_relaxed);
+			return true;
+		}
+	}
+	return false;
+}
+
+//申请和释放内存对象
+void* ThreadCache::Allocate(size_t size)
+{
 	// 自由链表为空的要去中心缓存中拿取内存对象，一次取多个防止多次去取而加锁带来的开销 
 	// 均衡策略:每次中心堆分配给ThreadCache对象的个数是个慢启动策略
 	//          随着取的次数增加而内存对象个数增加,防止一次给其他线程分配太多，而另一些线程申请
 	//          内存对象的时候必须去PageCache去取，带来效率问题
-	else
-	{
-		// 否则的话，从中心缓存处获取
-		return FetchFromCentralCache(index, SizeClass::Roundup(size));
-	}
+	const SizeInfo& info = SizeClass::Lookup(size);//获取到相对应的位置
+	return AllocateIndex(info._index, info._size);
 }
 
 void ThreadCache::Deallocate(void* ptr, size_t size)
 {
-	size_t index = SizeClass::Index(size);
-	Freelist* freelist = &_freelist[index];
-	freelist->Push(ptr);
-
 	//满足某个条件时(释放回一个批量的对象)，释放回中心缓存
-	if (freelist->Size() >= freelist->MaxSize())
+	const SizeInfo& info = SizeClass::Lookup(size);
+	DeallocateIndex(ptr, info._index, info._size);
+}
+
+void ThreadCache::AllocateBatch(size_t size, size_t n, void** out)
+{
+	const SizeInfo& info = SizeClass::Lookup(size);
+	Freelist* freelist = &_freelist[info._index];
+
+	//先用自由链表里现有的，不够的部分直接按缺的个数向中心缓存要，不经过自由链表
+	size_t got = freelist->PopBatch(out, n);
+	_bytes -= got * info._size;
+	//和FetchFromCentralCache一样按慢启动放大上限(按这一批要的个数算)，否则批量释放回来的对象超过上限又被还回中心缓存
+	if (got < n)
+		_GrowMaxSize(freelist, SizeClass::ClassNumMove(info._index), n);
+	try
 	{
-		ListTooLong(freelist, size);
+		while (got < n)
+		{
+			void* start = nullptr, *end = nullptr;
+			size_t batchsize = CentralCache::Getinstence()->FetchRangeObj(start, end, n - got, info._size);
+			_stats._classes[info._index]._misses.AddLocal(1);
+			_stats._classes[info._index]._fetched.AddLocal(batchsize);
+			for (size_t i = 0; i < batchsize; ++i)
+			{
+				out[got++] = start;
+				start = NEXT_OBJ(start);
+			}
+		}
 	}
+	catch (...)
+	{
+		//已经拿到的对象放回自由链表，不泄漏
+		_stats._classes[info._index]._allocs.AddLocal(got);
+		DeallocateBatch(out, got, size);
+		throw;
+	}
+	_stats._classes[info._index]._allocs.AddLocal(n);
 }
 
+void ThreadCache::DeallocateBatch(void** ptrs, size_t n, size_t size)
+{
+	if (n == 0)
+		return;
+
+	const SizeInfo& info = SizeClass::Lookup(size);
+	Freelist* freelist = &_freelist[info._index];
+	_stats._classes[info._index]._frees.AddLocal(n);
 
+	//先串成一条链，整段挂到自由链表上，超过上限的部分一次还给中心缓存
+	for (size_t i = 0; i + 1 < n; ++i)
+		NEXT_OBJ(ptrs[i]) = ptrs[i + 1];
+	freelist->PushRange(ptrs[0], ptrs[n - 1], n);
+	_bytes += n * info._size;
+
+	if (freelist->Size() >= freelist->MaxSize())
+		_ReleaseToCentral(freelist, info._index, info._size, freelist->Size() - freelist->MaxSize() + 1);
+	if (_bytes > _maxbytes.load(std::memory_order_relaxed))
+		OverLimit(n * info._size);
+}
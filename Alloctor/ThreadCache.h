@@ -1,25 +1,113 @@
 #pragma once
 
 #include "Common.h"
+#include "Stats.h"
 
+const size_t THREAD_CACHE_BUDGET = 32 << 20; //所有线程缓存加起来默认最多缓存的字节数
+const size_t MIN_THREAD_CACHE = 2 * MAX_BYTES; //每个线程缓存至少能缓存的字节数
+const size_t STEAL_BYTES = MAX_BYTES; //每次扩大上限时向全局预算或者其他线程要的字节数
+const size_t MAX_OVERAGES = 3; //自由链表连续超过上限这么多次就缩小上限
+const size_t MAX_FREELIST_LENGTH = 8192; //一个自由链表的上限最大能到多少个对象
+const size_t SCAVENGE_BYTES = MAX_BYTES; //扩大上限失败之后，超过上限的释放攒够这么多字节才再回收一次
+
+//所有线程缓存共享一份预算(THREAD_CACHE_BUDGET，环境变量CONCURRENT_ALLOC_THREAD_CACHE_BYTES可以修改)
+//每个缓存有自己的上限_maxbytes，缓存的字节数超过上限时回收一直没用到的对象(低水位的一半)，
+//然后从还没分出去的预算里扩大上限，预算分完了就从其他缓存偷一点，被偷的缓存下次超过上限时自己回收
+//都扩大不了时先超着，超过上限的释放攒够SCAVENGE_BYTES才再来一次，不在每次释放时都扫一遍所有自由链表
+//这样闲着的线程缓存会慢慢变小，忙的线程缓存变大，总量不随线程数增长
 class ThreadCache
 {
 private:
 	Freelist _freelist[NLISTS];//自由链表
+	CacheCounters _stats;//统计计数，只有拥有这个缓存的线程写
+	size_t _bytes = 0;//所有自由链表中对象的总字节数
+	std::atomic<size_t> _maxbytes;//允许缓存的字节数，其他线程偷预算时会减小它
+	size_t _overbytes = 0;//扩大上限失败之后释放的字节数，到SCAVENGE_BYTES时回收一次
+	ThreadCache* _prevcache = nullptr;//所有线程缓存的双向链表，偷预算时轮流找
+	ThreadCache* _nextcache = nullptr;
 
 public:
+	//创建时登记并从全局预算中拿到最小的上限
+	ThreadCache();
+	//线程退出时，把所有自由链表中的对象还给中心缓存，上限还给全局预算
+	~ThreadCache();
+
+	ThreadCache(const ThreadCache&) = delete;
+
+	//修改所有线程缓存的总预算，已经分出去的上限不会立刻收回
+	static void SetBudget(size_t bytes);
+	static size_t Budget();
+	//还没有分给任何线程缓存的预算，超支时为0
+	static size_t Unclaimed();
+
+	//缓存的字节数和允许缓存的字节数
+	size_t Bytes() const
+	{
+		return _bytes;
+	}
+	size_t MaxBytes() const
+	{
+		return _maxbytes.load(std::memory_order_relaxed);
+	}
+
 	//申请和释放内存对象
 	void* Allocate(size_t size);
 	void Deallocate(void* ptr, size_t size);
 
+	//一次申请/释放n个size大小的对象，自由链表和中心缓存都是整批操作
+	void AllocateBatch(size_t size, size_t n, void** out);
+	void DeallocateBatch(void** ptrs, size_t n, size_t size);
+
+	//自由链表的位置和对齐后的大小已经算好的版本(ConcurrentAllocT里是编译期常量)，内联后只剩一次链表操作
+	void* AllocateIndex(size_t index, size_t size)
+	{
+		Freelist* freelist = &_freelist[index];
+		_stats._classes[index]._allocs.AddLocal(1);
+		if (!freelist->Empty())
+		{
+			_bytes -= size;
+			return freelist->Pop();
+		}
+		return FetchFromCentralCache(index, size);
+	}
+
+	void DeallocateIndex(void* ptr, size_t index, size_t size)
+	{
+		Freelist* freelist = &_freelist[index];
+		_stats._classes[index]._frees.AddLocal(1);
+		freelist->Push(ptr);
+		_bytes += size;
+		if (freelist->Size() >= freelist->MaxSize())
+			ListTooLong(freelist, size);
+		if (_bytes > _maxbytes.load(std::memory_order_relaxed))
+			OverLimit(size);
+	}
+
 	//从中心缓存获取对象
 	void* FetchFromCentralCache(size_t index, size_t size);
 
 	//释放对象时，链表过长时，回收内存回到中心堆
 	void ListTooLong(Freelist* list, size_t size);
+
+	//释放bytes字节后缓存的字节数超过了上限，回收低水位再尝试扩大上限
+	void OverLimit(size_t bytes);
+
+	//每个自由链表还回低水位的一半
+	void Scavenge();
+
+private:
+	//把自由链表头部的n个对象还给中心缓存
+	void _ReleaseToCentral(Freelist* freelist, size_t index, size_t size, size_t n);
+	//扩大上限STEAL_BYTES字节，预算分完了并且偷不到时返回false
+	bool _IncreaseLimit();
+	//向中心缓存要过一次后调整自由链表的长度上限(慢启动)
+	void _GrowMaxSize(Freelist* freelist, size_t nummove, size_t batchsize);
 };
 
-//静态的，不是所有可见
 //每个线程有个自己的指针, 用(_declspec (thread))，我们在使用时，每次来都是自己的，就不用加锁了
-//每个线程都有自己的tlslist
-thread_local static ThreadCache* tlslist = nullptr;
\ No newline at end of file
+//每个线程都有自己的tlslist，所有编译单元共用同一个
+extern thread_local ThreadCache* tlslist;
+
+//第一次来的时候创建当前线程的ThreadCache，并注册线程退出时的回收
+//线程已经在退出流程中(ThreadCache已经销毁)时返回nullptr，调用者直接走中心缓存
+ThreadCache* CreateThreadCache();
\ No newline at end of file
@@ -0,0 +1,250 @@
+#include "TraceRecorder.h"
+#include <chrono>
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+//每个线程一个缓冲区，直接向系统申请，线程退出后留给下一个线程复用
+struct TraceBuffer
+{
+	SpinLock _lock; //只有Stop会和拥有它的线程竞争
+	unsigned int _tid = 0;
+	bool _inuse = false;
+	size_t _len = 0;
+	unsigned long long _base = 0; //块内第一条记录之前的时间
+	unsigned long long _lasttime = 0;
+	size_t _lastptr = 0;
+	TraceBuffer* _next = nullptr;
+	unsigned char _data[TRACE_BUFFER];
+};
+
+std::atomic<bool> TraceRecorder::_enabled(false);
+
+//锁的顺序：先拿缓冲区的锁，再拿tracemutex
+static std::mutex tracemutex; //保护文件和缓冲区链表
+static FILE* tracefile = nullptr;
+static TraceBuffer* tracebuffers = nullptr;
+static unsigned int tracetids = 0;
+static unsigned long long tracestart = 0;
+
+static thread_local TraceBuffer* tlstrace = nullptr;
+static thread_local bool tlsintrace = false; //写文件、创建缓冲区时可能再申请内存，这些不记录
+
+static unsigned long long NowNs()
+{
+	return (unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static unsigned char* PutVarint(unsigned char* p, unsigned long long v)
+{
+	while (v >= 0x80)
+	{
+		*p++ = (unsigned char)(v | 0x80);
+		v >>= 7;
+	}
+	*p++ = (unsigned char)v;
+	return p;
+}
+
+//调用者持有buf->_lock
+static void FlushBuffer(TraceBuffer* buf)
+{
+	if (buf->_len == 0)
+		return;
+
+	std::unique_lock<std::mutex> lock(tracemutex);
+	if (tracefile != nullptr)
+	{
+		unsigned int header[2] = { buf->_tid, (unsigned int)buf->_len };
+		fwrite(header, sizeof(header), 1, tracefile);
+		fwrite(&buf->_base, sizeof(buf->_base), 1, tracefile);
+		fwrite(buf->_data, 1, buf->_len, tracefile);
+	}
+	buf->_len = 0;
+}
+
+#ifndef _WIN32
+static pthread_key_t tracekey;
+static pthread_once_t traceonce = PTHREAD_ONCE_INIT;
+
+//线程退出时把剩下的记录写出去，缓冲区留给别的线程用
+static void ReleaseBuffer(void* ptr)
+{
+	tlsintrace = true; //线程已经在退出，后面的申请释放不再记录
+	TraceBuffer* buf = (TraceBuffer*)ptr;
+	buf->_lock.Lock();
+	FlushBuffer(buf);
+	buf->_lock.Unlock();
+
+	std::unique_lock<std::mutex> lock(tracemutex);
+	buf->_inuse = false;
+	tlstrace = nullptr;
+}
+
+static void CreateTraceKey()
+{
+	pthread_key_create(&tracekey, ReleaseBuffer);
+}
+#endif
+
+static TraceBuffer* GetBuffer()
+{
+	TraceBuffer* buf = nullptr;
+	{
+		std::unique_lock<std::mutex> lock(tracemutex);
+		for (TraceBuffer* cur = tracebuffers; cur != nullptr; cur = cur->_next)
+		{
+			if (!cur->_inuse)
+			{
+				buf = cur;
+				break;
+			}
+		}
+		if (buf == nullptr)
+		{
+			void* mem = SystemAlloc(SizeClass::_Roundup(sizeof(TraceBuffer), PAGE_SHIFT) >> PAGE_SHIFT);
+			if (mem == nullptr)
+				return nullptr;
+			buf = new(mem) TraceBuffer;
+			buf->_next = tracebuffers;
+			tracebuffers = buf;
+		}
+		buf->_inuse = true;
+		buf->_tid = ++tracetids; //复用的缓冲区也换一个新的线程号
+	}
+
+	tlstrace = buf;
+#ifndef _WIN32
+	pthread_once(&traceonce, CreateTraceKey);
+	pthread_setspecific(tracekey, buf);
+#endif
+	return buf;
+}
+
+void TraceRecorder::Record(unsigned char op, void* ptr, size_t size)
+{
+	if (tlsintrace)
+		return;
+	tlsintrace = true;
+
+	TraceBuffer* buf = tlstrace;
+	if (buf == nullptr)
+		buf = GetBuffer();
+	if (buf != nullptr)
+	{
+		buf->_lock.Lock();
+		//Stop已经处理过这个缓冲区之后，不能再写
+		if (_enabled.load(std::memory_order_relaxed))
+		{
+			//一条记录最多1+10+10+10字节
+			if (buf->_len + 32 > TRACE_BUFFER)
+				FlushBuffer(buf);
+
+			unsigned long long now = NowNs() - tracestart;
+			if (buf->_len == 0)
+			{
+				buf->_base = now;
+				buf->_lasttime = now;
+				buf->_lastptr = 0;
+			}
+
+			//地址至少8字节对齐，和上一条记录的差用zigzag编码，连续申请的地址通常很近
+			size_t addr = (size_t)ptr >> 3;
+			long long diff = (long long)(addr - buf->_lastptr);
+			unsigned long long zigzag = ((unsigned long long)diff << 1) ^ (unsigned long long)(diff >> 63);
+
+			unsigned char* p = buf->_data + buf->_len;
+			*p++ = op;
+			p = PutVarint(p, now - buf->_lasttime);
+			p = PutVarint(p, zigzag);
+			if (op == TRACE_ALLOC)
+				p = PutVarint(p, size);
+			buf->_len = p - buf->_data;
+			buf->_lasttime = now;
+			buf->_lastptr = addr;
+		}
+		buf->_lock.Unlock();
+	}
+
+	tlsintrace = false;
+}
+
+bool TraceRecorder::Start(const char* path)
+{
+	bool intrace = tlsintrace;
+	tlsintrace = true;
+
+	bool ok = false;
+	{
+		std::unique_lock<std::mutex> lock(tracemutex);
+		if (tracefile == nullptr)
+		{
+			tracefile = fopen(path, "wb");
+			if (tracefile != nullptr)
+			{
+				//不用stdio的缓冲，写文件时不会再申请内存
+				setvbuf(tracefile, nullptr, _IONBF, 0);
+				fwrite(TRACE_MAGIC, sizeof(TRACE_MAGIC), 1, tracefile);
+				tracestart = NowNs();
+				_enabled.store(true, std::memory_order_relaxed);
+				ok = true;
+			}
+		}
+	}
+
+	tlsintrace = intrace;
+	return ok;
+}
+
+void TraceRecorder::Stop()
+{
+	bool intrace = tlsintrace;
+	tlsintrace = true;
+
+	_enabled.store(false, std::memory_order_relaxed);
+
+	//缓冲区只会增加不会释放，拿到链表头之后不持有tracemutex也可以遍历
+	TraceBuffer* head = nullptr;
+	{
+		std::unique_lock<std::mutex> lock(tracemutex);
+		head = tracebuffers;
+	}
+	for (TraceBuffer* buf = head; buf != nullptr; buf = buf->_next)
+	{
+		buf->_lock.Lock();
+		FlushBuffer(buf);
+		buf->_lock.Unlock();
+	}
+
+	{
+		std::unique_lock<std::mutex> lock(tracemutex);
+		if (tracefile != nullptr)
+		{
+			fclose(tracefile);
+			tracefile = nullptr;
+		}
+	}
+
+	tlsintrace = intrace;
+}
+
+static void StopAtExit()
+{
+	TraceRecorder::Stop();
+}
+
+//设置了环境变量就在进程启动时开始记录，退出时结束
+static bool StartFromEnv()
+{
+	const char* path = getenv("CONCURRENT_ALLOC_TRACE");
+	if (path == nullptr || path[0] == '\0')
+		return false;
+	if (!TraceRecorder::Start(path))
+		return false;
+	atexit(StopAtExit);
+	return true;
+}
+
+bool TraceRecorder::_fromenv = StartFromEnv();
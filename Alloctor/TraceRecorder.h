@@ -0,0 +1,53 @@
+#pragma once
+
+#include "Common.h"
+#include <stdio.h>
+
+//trace文件格式(所有整数都是小端)：
+//  文件头 "CATRACE1"
+//  若干个块：uint32 线程号，uint32 数据字节数，uint64 块内第一条记录之前的时间(纳秒)，然后是数据
+//  每条记录：1字节操作(TRACE_ALLOC/TRACE_FREE)，
+//            varint 和上一条记录的时间差，varint 地址/8和上一条记录的差(zigzag)，
+//            申请时再跟一个 varint 大小
+//同一个块里的记录来自同一个线程，按时间顺序排列；不同线程的块交错写入，回放时按时间重新排序
+const char TRACE_MAGIC[8] = { 'C', 'A', 'T', 'R', 'A', 'C', 'E', '1' };
+const unsigned char TRACE_ALLOC = 0;
+const unsigned char TRACE_FREE = 1;
+const size_t TRACE_BUFFER = 64 * 1024; //每个线程的缓冲区大小，写满一次写一个块
+
+//记录ConcurrentAlloc/ConcurrentFree的调用序列，用Replay工具离线回放
+//每个线程先写到自己的缓冲区，满了再加锁写文件，热路径上只有自己缓冲区的自旋锁(没有竞争)
+//调用Start开始记录，或者设置环境变量CONCURRENT_ALLOC_TRACE=文件名，进程启动时自动开始、退出时自动结束
+class TraceRecorder
+{
+public:
+	static bool Enabled()
+	{
+		return _enabled.load(std::memory_order_relaxed);
+	}
+
+	//开始记录到path，已经在记录时返回false
+	static bool Start(const char* path);
+	//把所有线程缓冲区里的记录写进文件并关闭
+	static void Stop();
+
+	static void Record(unsigned char op, void* ptr, size_t size);
+
+private:
+	static std::atomic<bool> _enabled;
+	static bool _fromenv; //是否由环境变量自动开始
+};
+
+//申请成功之后调用
+static inline void TraceAlloc(void* ptr, size_t size)
+{
+	if (TraceRecorder::Enabled())
+		TraceRecorder::Record(TRACE_ALLOC, ptr, size);
+}
+
+//释放之前调用，ptr必须是申请时返回的地址
+static inline void TraceFree(void* ptr)
+{
+	if (TraceRecorder::Enabled())
+		TraceRecorder::Record(TRACE_FREE, ptr, 0);
+}
@@ -0,0 +1,137 @@
+#pragma once
+
+#include "Common.h"
+#include "Stats.h"
+
+const size_t MAX_BATCHES = 16; //每个大小的transfer cache最多缓存多少批对象
+const size_t TRANSFER_CACHE_BYTES = 2 * MAX_BYTES; //每个大小的transfer cache最多缓存的字节数(至少能放一批)
+
+//一批已经链好的对象
+struct TransferBatch
+{
+	void* _start;
+	void* _end;
+	size_t _num;
+};
+
+//ThreadCache和CentralCache之间的中转缓存，每个自由链表位置一个
+//ThreadCache还回来的一整批对象原样放在这里，下一个来取的线程直接整批拿走，
+//不用逐个对象地去span上挂链表和摘链表，临界区只有几条赋值语句，用自旋锁保护
+//缓存的对象不会自己回到span，PageCache回收内存时用RemoveAll整个取出来还给span
+class TransferCache
+{
+private:
+	TransferBatch _batches[MAX_BATCHES];
+	size_t _size = 0;
+	size_t _bytes = 0; //缓存的对象的总字节数
+	size_t _accesses = 0; //放入和取出的次数，回收时和上次看到的比较，判断是不是一直没用
+	size_t _seen = 0;
+	SpinLock _lock;
+	StatCounter _waits; //锁竞争次数
+
+	void _Lock()
+	{
+		if (!_lock.TryLock())
+		{
+			_waits.Add(1);
+			_lock.Lock();
+		}
+	}
+
+public:
+	//放入一批size字节的对象，批数或者字节数满了返回false
+	bool Insert(void* start, void* end, size_t n, size_t size)
+	{
+		_Lock();
+		if (_size == MAX_BATCHES || (_size > 0 && _bytes + n * size > TRANSFER_CACHE_BYTES))
+		{
+			_lock.Unlock();
+			return false;
+		}
+		TransferBatch& batch = _batches[_size++];
+		batch._start = start;
+		batch._end = end;
+		batch._num = n;
+		_bytes += n * size;
+		++_accesses;
+		_lock.Unlock();
+		return true;
+	}
+
+	//从最近放入的一批对象中取最多n个，这批比n多时拆开，剩下的留在缓存里，没有对象返回0
+	size_t Remove(void*& start, void*& end, size_t n, size_t size)
+	{
+		_Lock();
+		if (_size == 0 || n == 0)
+		{
+			_lock.Unlock();
+			return 0;
+		}
+		TransferBatch& batch = _batches[_size - 1];
+		size_t num = batch._num;
+		start = batch._start;
+		if (num <= n)
+		{
+			end = batch._end;
+			--_size;
+		}
+		else
+		{
+			//只拆最上面一批，沿着链表走n个对象
+			void* last = start;
+			for (size_t i = 1; i < n; ++i)
+				last = NEXT_OBJ(last);
+			batch._start = NEXT_OBJ(last);
+			batch._num = num - n;
+			NEXT_OBJ(last) = nullptr;
+			end = last;
+			num = n;
+		}
+		_bytes -= num * size;
+		++_accesses;
+		_lock.Unlock();
+		return num;
+	}
+
+	//取出所有对象串成一条以nullptr结尾的链表，返回个数
+	//idle为true时只在上次调用之后没有放入和取出过的时候才取
+	size_t RemoveAll(void*& start, bool idle = false)
+	{
+		_Lock();
+		bool used = _accesses != _seen;
+		_seen = _accesses;
+		if (_size == 0 || (idle && used))
+		{
+			_lock.Unlock();
+			return 0;
+		}
+		size_t num = 0;
+		start = nullptr;
+		while (_size > 0)
+		{
+			TransferBatch& batch = _batches[--_size];
+			NEXT_OBJ(batch._end) = start;
+			start = batch._start;
+			num += batch._num;
+		}
+		_bytes = 0;
+		_lock.Unlock();
+		return num;
+	}
+
+	//缓存的对象个数，统计用
+	size_t Count()
+	{
+		_Lock();
+		size_t num = 0;
+		for (size_t i = 0; i < _size; ++i)
+			num += _batches[i]._num;
+		_lock.Unlock();
+		return num;
+	}
+
+	size_t Waits() const
+	{
+		return _waits.Get();
+	}
+};
@@ -0,0 +1,242 @@
+#include "Common.h"
+#include <fstream>
+#include <string>
+
+// 按实际的申请大小分布生成一组对象大小，代替SizeClassGen里按固定步长的规则
+// 用法：tuner [-w 最大浪费比例] [-o 输出文件] 大小分布文件
+//   大小分布文件每行"大小 次数"，用 replay -d 可以从TraceRecorder记录的trace得到
+//   -w  一个对象大小最坏情况下的浪费比例，默认0.125，分布里没有出现的大小也不会浪费太多
+//   -o  生成的头文件，默认输出到标准输出
+// 编译分配器时定义 CONCURRENT_ALLOC_SIZE_CLASSES="生成的头文件"(cmake -DSIZE_CLASSES=头文件)使用生成的对象大小
+//
+// 代价是每次申请向上取整浪费的字节数，加上span末尾切不出对象的字节数分摊到每个对象上
+// 候选的对象大小就是查找表的粒度(1024以内8字节，以上128字节)，用动态规划选出NLISTS个代价最小的
+// 16以上只选16的倍数，替换系统malloc时返回的地址要16字节对齐；其他候选只用来统计分布和当前对象大小的代价
+// 分布之外再给所有大小加上总次数1%的均匀分布，没有出现过的大小也能分到合理的对象大小
+
+const double PRIOR = 0.01;
+const double INF = 1e300;
+
+struct Candidate
+{
+	size_t _size;
+	double _tail; //span末尾的浪费分摊到每个对象上的字节数
+	double _count; //取整到这个大小的申请次数(包括均匀分布)
+	double _bytes; //这些申请的字节数
+	double _realcount; //只算分布里的
+	double _realbytes;
+};
+
+//取整到候选大小的下标
+static size_t CandidateOf(size_t size)
+{
+	if (size <= 1024)
+		return size == 0 ? 0 : ((size + 7) >> 3) - 1;
+	return 127 + ((size - 1024 + 127) >> 7);
+}
+
+static std::vector<Candidate> MakeCandidates()
+{
+	std::vector<Candidate> cands;
+	for (size_t size = 8; size <= MAX_BYTES; size += size < 1024 ? 8 : 128)
+	{
+		Candidate cand;
+		size_t bytes = SizeClassGen::NumMovePage(size) << PAGE_SHIFT;
+		cand._size = size;
+		cand._tail = (double)(bytes % size) / (bytes / size);
+		cand._count = cand._bytes = cand._realcount = cand._realbytes = 0;
+		cands.push_back(cand);
+	}
+	return cands;
+}
+
+static bool LoadHistogram(const char* path, std::vector<Candidate>& cands, double& total, double& bytes)
+{
+	std::ifstream in(path);
+	if (!in)
+		return false;
+	total = bytes = 0;
+	std::string line;
+	while (std::getline(in, line))
+	{
+		size_t size = 0, count = 1;
+		if (sscanf(line.c_str(), "%zu %zu", &size, &count) < 1 || size > MAX_BYTES)
+			continue;
+		Candidate& cand = cands[CandidateOf(size)];
+		cand._realcount += count;
+		cand._realbytes += (double)size * count;
+		total += count;
+		bytes += (double)size * count;
+	}
+	if (total == 0)
+		return false;
+
+	for (size_t j = 0; j < cands.size(); ++j)
+	{
+		size_t prev = j == 0 ? 0 : cands[j - 1]._size;
+		double count = total * PRIOR * (cands[j]._size - prev) / MAX_BYTES;
+		cands[j]._count = cands[j]._realcount + count;
+		cands[j]._bytes = cands[j]._realbytes + count * (prev + 1 + cands[j]._size) / 2;
+	}
+	return true;
+}
+
+//用cands[j]作为对象大小，放下(cands[i]，cands[j]]之间所有申请的代价，i为-1表示从0开始
+struct CostModel
+{
+	std::vector<double> _count; //前缀和，_count[j+1]是cands[0..j]的和
+	std::vector<double> _bytes;
+	const std::vector<Candidate>& _cands;
+
+	CostModel(const std::vector<Candidate>& cands, bool real)
+		: _count(cands.size() + 1, 0), _bytes(cands.size() + 1, 0), _cands(cands)
+	{
+		for (size_t j = 0; j < cands.size(); ++j)
+		{
+			_count[j + 1] = _count[j] + (real ? cands[j]._realcount : cands[j]._count);
+			_bytes[j + 1] = _bytes[j] + (real ? cands[j]._realbytes : cands[j]._bytes);
+		}
+	}
+
+	double Cost(long i, size_t j) const
+	{
+		double count = _count[j + 1] - _count[i + 1];
+		double bytes = _bytes[j + 1] - _bytes[i + 1];
+		return count * (_cands[j]._size + _cands[j]._tail) - bytes;
+	}
+
+	//一组对象大小(都是候选大小)的总代价
+	double Total(const std::vector<size_t>& classes) const
+	{
+		double total = 0;
+		long prev = -1;
+		for (size_t size : classes)
+		{
+			size_t j = CandidateOf(size);
+			total += Cost(prev, j);
+			prev = (long)j;
+		}
+		return total;
+	}
+};
+
+//能不能选作对象大小，和MallocOverride.cpp的MIN_ALIGN一致
+static bool Selectable(size_t size)
+{
+	return size <= 16 || size % 16 == 0;
+}
+
+//对象大小cands[j]能不能紧接在大小为prev的对象大小后面
+static bool Feasible(size_t prev, size_t size, double maxwaste)
+{
+	double limit = size * maxwaste;
+	double step = size <= 16 ? 8 : size <= 1024 ? 16 : 128;
+	return size - prev <= (limit > step ? limit : step);
+}
+
+static bool Tune(const std::vector<Candidate>& cands, double maxwaste, std::vector<size_t>& classes)
+{
+	CostModel model(cands, false);
+	size_t m = cands.size();
+	std::vector<std::vector<double> > dp(NLISTS, std::vector<double>(m, INF));
+	std::vector<std::vector<long> > from(NLISTS, std::vector<long>(m, -1));
+
+	//dp[k][j]：用k+1个对象大小放下不超过cands[j]的申请，最大的一个是cands[j]
+	for (size_t j = 0; j < m && Feasible(0, cands[j]._size, maxwaste); ++j)
+		if (Selectable(cands[j]._size))
+			dp[0][j] = model.Cost(-1, j);
+	for (size_t k = 1; k < NLISTS; ++k)
+	{
+		for (size_t j = k; j < m; ++j)
+		{
+			if (!Selectable(cands[j]._size))
+				continue;
+			for (long i = (long)j - 1; i >= (long)k - 1 && Feasible(cands[i]._size, cands[j]._size, maxwaste); --i)
+			{
+				if (dp[k - 1][i] >= INF)
+					continue;
+				double cost = dp[k - 1][i] + model.Cost(i, j);
+				if (cost < dp[k][j])
+				{
+					dp[k][j] = cost;
+					from[k][j] = i;
+				}
+			}
+		}
+	}
+
+	if (dp[NLISTS - 1][m - 1] >= INF)
+		return false;
+	classes.resize(NLISTS);
+	long j = (long)m - 1;
+	for (size_t k = NLISTS; k-- > 0;)
+	{
+		classes[k] = cands[j]._size;
+		j = from[k][j];
+	}
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	const char* path = nullptr;
+	const char* output = nullptr;
+	double maxwaste = 0.125;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+			maxwaste = atof(argv[++i]);
+		else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+			output = argv[++i];
+		else
+			path = argv[i];
+	}
+	if (path == nullptr || maxwaste <= 0)
+	{
+		fprintf(stderr, "usage: %s [-w max waste ratio] [-o output header] size distribution\n", argv[0]);
+		return 1;
+	}
+
+	std::vector<Candidate> cands = MakeCandidates();
+	double total, bytes;
+	if (!LoadHistogram(path, cands, total, bytes))
+	{
+		fprintf(stderr, "cannot read size distribution from %s\n", path);
+		return 1;
+	}
+
+	std::vector<size_t> classes;
+	if (!Tune(cands, maxwaste, classes))
+	{
+		fprintf(stderr, "%zu size classes cannot keep the waste under %.1f%%, use a larger -w\n",
+			NLISTS, maxwaste * 100);
+		return 1;
+	}
+
+	std::vector<size_t> current;
+	for (size_t i = 0; i < NLISTS; ++i)
+		current.push_back(SizeClassGen::ClassSize(i));
+	CostModel real(cands, true);
+	double before = real.Total(current), after = real.Total(classes);
+	fprintf(stderr, "%.0f allocations, %.0f bytes\n", total, bytes);
+	fprintf(stderr, "current classes: %12.0f bytes wasted (%.2f%%)\n", before, before * 100 / bytes);
+	fprintf(stderr, "tuned classes:   %12.0f bytes wasted (%.2f%%)\n", after, after * 100 / bytes);
+
+	FILE* out = output == nullptr ? stdout : fopen(output, "w");
+	if (out == nullptr)
+	{
+		fprintf(stderr, "cannot write %s\n", output);
+		return 1;
+	}
+	fprintf(out, "#pragma once\n\n");
+	fprintf(out, "// tuner根据%s生成，最坏浪费比例%.3f\n", path, maxwaste);
+	fprintf(out, "// %.0f次申请，浪费的字节数(包括span末尾)：生成时的对象大小%.2f%%，这张表%.2f%%\n",
+		total, before * 100 / bytes, after * 100 / bytes);
+	fprintf(out, "constexpr size_t TUNED_CLASS_SIZES[] = {");
+	for (size_t i = 0; i < classes.size(); ++i)
+		fprintf(out, "%s%zu%s", i % 8 == 0 ? "\n\t" : " ", classes[i], i + 1 < classes.size() ? "," : "");
+	fprintf(out, "\n};\n");
+	if (out != stdout)
+		fclose(out);
+	return 0;
+}
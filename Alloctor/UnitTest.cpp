@@ -1,6 +1,8 @@
 #include "Common.h"
 #include "PageCache.h"
 #include "ConcurrentAlloc.h"
+#include "SystemAllocator.h"
+#include "LargeCache.h"
 
 #define TESTALLOCSIZE 10
 
@@ -21,6 +23,7 @@ do {\
 
 void TestSize()
 {	
+#ifndef CONCURRENT_ALLOC_SIZE_CLASSES // 默认规则下的位置和大小
 	EXPECT_RET_SIZE_T(1, SizeClass::Index(10));
 	EXPECT_RET_SIZE_T(1, SizeClass::Index(16));
 	EXPECT_RET_SIZE_T(15, SizeClass::Index(128));
@@ -33,6 +36,7 @@ void TestSize()
 	EXPECT_RET_SIZE_T(16, SizeClass::Roundup(10));
 	EXPECT_RET_SIZE_T(1024 + 128, SizeClass::Roundup(1025));
 	EXPECT_RET_SIZE_T(1024 * 8 + 1024, SizeClass::Roundup(1024*8+1));
+#endif
 
 	std::vector<size_t> v{ 4,8,16,32,64,128,256,512,1024,1024 * 8,1024 * 16,1024 * 64,1024 * 128 };
 	for (size_t& s : v)
@@ -40,6 +44,40 @@ void TestSize()
 		cout << s << "\t" << SizeClass::NumMoveSize(s) << "\t" << SizeClass::NumMovePage(s) << endl;
 	}
 }
+
+//查找表和原来按区间计算的结果一致
+void TestSizeTable()
+{
+	size_t wrongindex = 0, wrongsize = 0, wrongmove = 0;
+	size_t index = 0;
+	for (size_t s = 1; s <= MAX_BYTES; ++s)
+	{
+		size_t roundup;
+#ifdef CONCURRENT_ALLOC_SIZE_CLASSES
+		// Tuner生成的表没有规则，按顺序找第一个放得下的
+		while (SizeClassGen::ClassSize(index) < s)
+			++index;
+		roundup = SizeClassGen::ClassSize(index);
+#else
+		if (s <= 128)
+			index = SizeClass::_Index(s, 3), roundup = SizeClass::_Roundup(s, 3);
+		else if (s <= 1024)
+			index = SizeClass::_Index(s - 128, 4) + 16, roundup = SizeClass::_Roundup(s, 4);
+		else if (s <= 8 * 1024)
+			index = SizeClass::_Index(s - 1024, 7) + 72, roundup = SizeClass::_Roundup(s, 7);
+		else
+			index = SizeClass::_Index(s - 8 * 1024, 10) + 128, roundup = SizeClass::_Roundup(s, 10);
+#endif
+
+		wrongindex += SizeClass::Index(s) != index;
+		wrongsize += SizeClass::Roundup(s) != roundup || SizeClass::Size(index) != roundup;
+		wrongmove += SizeClass::ClassNumMove(index) != SizeClass::NumMoveSize(roundup)
+			|| SizeClass::ClassNumPage(index) != SizeClass::NumMovePage(roundup);
+	}
+	EXPECT_RET_SIZE_T((size_t)0, wrongindex);
+	EXPECT_RET_SIZE_T((size_t)0, wrongsize);
+	EXPECT_RET_SIZE_T((size_t)0, wrongmove);
+}
 std::mutex mtx;
 void static Alloc(size_t n, size_t size)//申请和释放测试
 {
@@ -133,6 +171,664 @@ void static TestConcurrentAllocFree()
 	cout << "hehe" << endl;
 }
 
+void static TestPageMap()
+{
+	void* ptr1 = ConcurrentAlloc(TESTALLOCSIZE);
+	void* ptr2 = ConcurrentAlloc(65 << PAGE_SHIFT);
+	void* ptr3 = ConcurrentAlloc(129 << PAGE_SHIFT);
+
+	// 对象内部任意地址都应该映射到同一个span
+	Span* span1 = PageCache::GetInstence()->MapObjectToSpan(ptr1);
+	EXPECT_RET_SIZE_T(SizeClass::Roundup(TESTALLOCSIZE), span1->_objsize);
+	Span* span2 = PageCache::GetInstence()->MapObjectToSpan(ptr2);
+	EXPECT_RET_SIZE_T((size_t)(65 << PAGE_SHIFT), span2->_objsize);
+	EXPECT_RET_SIZE_T((size_t)span2, (size_t)PageCache::GetInstence()->MapObjectToSpan((char*)ptr2 + (64 << PAGE_SHIFT)));
+	Span* span3 = PageCache::GetInstence()->MapObjectToSpan(ptr3);
+	EXPECT_RET_SIZE_T((size_t)(129 << PAGE_SHIFT), span3->_objsize);
+
+	ConcurrentFree(ptr1);
+	ConcurrentFree(ptr2);
+	ConcurrentFree(ptr3);
+}
+
+void static TestPageAlign()
+{
+	// span的起始地址必须按页对齐，否则页号和地址对应不上
+	size_t mask = (1 << PAGE_SHIFT) - 1;
+	void* ptr1 = ConcurrentAlloc(65 << PAGE_SHIFT);
+	void* ptr2 = ConcurrentAlloc(129 << PAGE_SHIFT);
+	EXPECT_RET_SIZE_T((size_t)0, (size_t)ptr1 & mask);
+	EXPECT_RET_SIZE_T((size_t)0, (size_t)ptr2 & mask);
+
+	EXPECT_RET_SIZE_T((size_t)ptr1 >> PAGE_SHIFT, (size_t)PageCache::GetInstence()->MapObjectToSpan(ptr1)->_pageid);
+	EXPECT_RET_SIZE_T((size_t)ptr2 >> PAGE_SHIFT, (size_t)PageCache::GetInstence()->MapObjectToSpan(ptr2)->_pageid);
+
+	ConcurrentFree(ptr1);
+	ConcurrentFree(ptr2);
+}
+
+void static TestScavenge()
+{
+	// 使用透明大页时只还整个空闲的大页，这里测按span回收
+	bool hugepages = SystemAllocator::HugePages();
+	SystemAllocator::SetHugePages(false);
+
+	void* ptr = ConcurrentAlloc(65 << PAGE_SHIFT);
+	ConcurrentFree(ptr);
+
+	// 刚释放的span还没有空闲够一分钟，不会被回收
+	PageCache::GetInstence()->Scavenge(60 * 1000);
+	EXPECT_RET_SIZE_T((size_t)0, (size_t)PageCache::GetInstence()->MapObjectToSpan(ptr)->_released);
+
+	// 主动回收，页号映射仍然保留
+	size_t released = PageCache::GetInstence()->ReleaseToSystem(1);
+	EXPECT_RET_SIZE_T((size_t)1, (size_t)(released >= (65 << PAGE_SHIFT)));
+	EXPECT_RET_SIZE_T((size_t)1, (size_t)PageCache::GetInstence()->MapObjectToSpan(ptr)->_released);
+
+	// 回收后的内存可以再次使用，重新拿出去的span不再算作已经还给系统
+	ptr = ConcurrentAlloc(65 << PAGE_SHIFT);
+	EXPECT_RET_SIZE_T((size_t)0, (size_t)PageCache::GetInstence()->MapObjectToSpan(ptr)->_released);
+	memset(ptr, 1, 65 << PAGE_SHIFT);
+	ConcurrentFree(ptr);
+	EXPECT_RET_SIZE_T((size_t)0, (size_t)PageCache::GetInstence()->MapObjectToSpan(ptr)->_released);
+
+	// 再次释放后可以再还给系统一次
+	AllocatorStats stats;
+	PageCache::GetInstence()->GetStats(stats);
+	size_t before = stats._pagereleasedbytes;
+	released = PageCache::GetInstence()->ReleaseToSystem(1);
+	EXPECT_RET_SIZE_T((size_t)1, (size_t)(released >= (65 << PAGE_SHIFT)));
+	EXPECT_RET_SIZE_T((size_t)1, (size_t)PageCache::GetInstence()->MapObjectToSpan(ptr)->_released);
+	PageCache::GetInstence()->GetStats(stats);
+	EXPECT_RET_SIZE_T((size_t)1, (size_t)(stats._pagereleasedbytes >= before + (65 << PAGE_SHIFT)));
+
+	SystemAllocator::SetHugePages(hugepages);
+}
+
+void static TestThreadExit()
+{
+	// 线程退出时ThreadCache里的对象要还回去，整个span空闲后回到PageCache
+	void* ptr = nullptr;
+	std::thread t1([&ptr]() {
+		ptr = ConcurrentAlloc(60 * 1024);
+		ConcurrentFree(ptr);
+	});
+	t1.join();
+	if (!CpuCache::Enabled())// 每个CPU一个缓存时，对象不跟着线程走
+		EXPECT_RET_SIZE_T((size_t)0, (size_t)PageCache::GetInstence()->MapObjectToSpan(ptr)->_isuse);
+
+	// 在没有申请过内存的线程中释放，对象经过中心缓存后可以被其他线程再次拿到
+	ptr = ConcurrentAlloc(60 * 1024);
+	std::thread t2([ptr]() {
+		ConcurrentFree(ptr);
+	});
+	t2.join();
+	void* again = ConcurrentAlloc(60 * 1024);
+	EXPECT_RET_SIZE_T((size_t)ptr, (size_t)again);
+	ConcurrentFree(again);
+}
+
+void static TestSizedFree()
+{
+	// 带大小释放的对象回到同一个自由链表，下一次申请直接拿到它
+	size_t sizes[] = { 1, 100, 1000, 5000, 60 * 1024, 65 << PAGE_SHIFT };
+	for (size_t size : sizes)
+	{
+		void* ptr = ConcurrentAlloc(size);
+		ConcurrentFree(ptr, size);
+		void* again = ConcurrentAlloc(size);
+		if (size <= MAX_BYTES)
+			EXPECT_RET_SIZE_T((size_t)ptr, (size_t)again);
+		ConcurrentFree(again, size);
+	}
+}
+
+struct TypedNode
+{
+	char _data[1000];
+};
+
+void static TestTypedAlloc()
+{
+	// 编译期算出的位置和运行时查表的结果一致
+	EXPECT_RET_SIZE_T(SizeClass::Index(1), (size_t)SizeClassOf<1>::index);
+	EXPECT_RET_SIZE_T(SizeClass::Index(129), (size_t)SizeClassOf<129>::index);
+	EXPECT_RET_SIZE_T(SizeClass::Roundup(1025), (size_t)SizeClassOf<1025>::size);
+	EXPECT_RET_SIZE_T(SizeClass::Index(MAX_BYTES), (size_t)SizeClassOf<MAX_BYTES>::index);
+
+	// 和按大小申请释放的对象在同一个自由链表里
+	TypedNode* node = ConcurrentAllocT<TypedNode>();
+	ConcurrentFree(node, sizeof(TypedNode));
+	void* again = ConcurrentAlloc(sizeof(TypedNode));
+	EXPECT_RET_SIZE_T((size_t)node, (size_t)again);
+	ConcurrentFreeT((TypedNode*)again);
+	EXPECT_RET_SIZE_T((size_t)node, (size_t)ConcurrentAllocT<TypedNode>());
+	ConcurrentFree(node);
+
+	struct Big { char _data[MAX_BYTES + 1]; };
+	Big* big = ConcurrentAllocT<Big>();
+	EXPECT_RET_SIZE_T((size_t)1, (size_t)(big != nullptr));
+	ConcurrentFreeT(big);
+}
+
+//一批对象里有没有互相重叠的
+static size_t CountOverlap(std::vector<void*> ptrs, size_t size)
+{
+	std::sort(ptrs.begin(), ptrs.end());
+	size_t overlap = 0;
+	for (size_t i = 0; i + 1 < ptrs.size(); ++i)
+		overlap += (char*)ptrs[i] + size > (char*)ptrs[i + 1];
+	return overlap;
+}
+
+void static TestBatch()
+{
+	size_t sizes[] = { 8, 100, 5000, 65 << PAGE_SHIFT };
+	for (size_t size : sizes)
+	{
+		const size_t n = size > MAX_BYTES ? 4 : 1000;
+		std::vector<void*> ptrs(n);
+		ConcurrentAllocBatch(size, n, ptrs.data());
+		for (size_t i = 0; i < n; ++i)
+			memset(ptrs[i], (int)i, size);
+		EXPECT_RET_SIZE_T((size_t)0, CountOverlap(ptrs, size));
+		ConcurrentFreeBatch(ptrs.data(), n, size);
+
+		// 整批释放的对象可以再被整批申请，不带大小的释放按span查大小
+		ConcurrentAllocBatch(size, n, ptrs.data());
+		EXPECT_RET_SIZE_T((size_t)0, CountOverlap(ptrs, size));
+		ConcurrentFreeBatch(ptrs.data(), n, 0);
+	}
+
+	// 反复整批申请释放，自由链表上限跟着慢启动放大，之后全部命中线程缓存
+	size_t misses = 0;
+	std::thread([&misses]() {
+		const size_t size = 200, n = 16;
+		size_t index = SizeClass::Index(size);
+		void* ptrs[n];
+		for (size_t round = 0; round < 64; ++round)
+		{
+			size_t before = GetStats()._classes[index]._misses;
+			ConcurrentAllocBatch(size, n, ptrs);
+			misses = GetStats()._classes[index]._misses - before;
+			ConcurrentFreeBatch(ptrs, n, size);
+		}
+	}).join();
+	EXPECT_RET_SIZE_T((size_t)0, misses);
+}
+
+void static TestAligned()
+{
+	size_t misaligned = 0, tooshort = 0;
+	for (size_t align = 8; align <= (16 << PAGE_SHIFT); align <<= 1)
+	{
+		size_t sizes[] = { 1, 24, 100, 1000, 1025, 5000, 60 * 1024, 65 << PAGE_SHIFT };
+		for (size_t size : sizes)
+		{
+			void* ptr = ConcurrentAllocAligned(size, align);
+			misaligned += ((size_t)ptr & (align - 1)) != 0;
+			tooshort += ConcurrentUsableSize(ptr) < size;
+			memset(ptr, 0, ConcurrentUsableSize(ptr));
+			ConcurrentFree(ptr);
+		}
+	}
+	EXPECT_RET_SIZE_T((size_t)0, misaligned);
+	EXPECT_RET_SIZE_T((size_t)0, tooshort);
+
+	// 小对象可用的大小就是自由链表对象的大小
+	void* ptr = ConcurrentAlloc(100);
+	EXPECT_RET_SIZE_T(SizeClass::Roundup(100), ConcurrentUsableSize(ptr));
+	ConcurrentFree(ptr);
+}
+
+void static TestRealloc()
+{
+	// 还在同一个自由链表对象里时原地返回
+	void* ptr = ConcurrentAlloc(100);
+	EXPECT_RET_SIZE_T((size_t)ptr, (size_t)ConcurrentRealloc(ptr, SizeClass::Roundup(100)));
+
+	// 依次扩展到大对象、超过128页的直接映射，再缩小，内容一直保留
+	size_t sizes[] = { 5000, 70 << PAGE_SHIFT, 100 << PAGE_SHIFT, 200 << PAGE_SHIFT, 400 << PAGE_SHIFT, 300 << PAGE_SHIFT, 50 };
+	size_t prev = SizeClass::Roundup(100);
+	memset(ptr, 0x5a, prev);
+	size_t broken = 0, tooshort = 0;
+	for (size_t size : sizes)
+	{
+		ptr = ConcurrentRealloc(ptr, size);
+		tooshort += ConcurrentUsableSize(ptr) < size;
+		size_t keep = prev < size ? prev : size;
+		for (size_t i = 0; i < keep; i += 64)
+			broken += ((unsigned char*)ptr)[i] != 0x5a;
+		memset(ptr, 0x5a, size);
+		prev = size;
+	}
+	EXPECT_RET_SIZE_T((size_t)0, broken);
+	EXPECT_RET_SIZE_T((size_t)0, tooshort);
+	EXPECT_RET_SIZE_T((size_t)0, (size_t)ConcurrentRealloc(ptr, 0));
+
+	// 后面紧挨着别的映射时原地放不下，搬家之后新地址能查到span，内容保留
+	void* below = ConcurrentAlloc(200 << PAGE_SHIFT);
+	void* above = ConcurrentAlloc(200 << PAGE_SHIFT);
+	void* moved = (char*)below < (char*)above ? below : above;
+	memset(moved, 0x5a, 200 << PAGE_SHIFT);
+	moved = ConcurrentRealloc(moved, 400 << PAGE_SHIFT);
+	broken = 0;
+	for (size_t i = 0; i < (200 << PAGE_SHIFT); i += 64)
+		broken += ((unsigned char*)moved)[i] != 0x5a;
+	EXPECT_RET_SIZE_T((size_t)0, broken);
+	EXPECT_RET_SIZE_T((size_t)1, (size_t)(ConcurrentUsableSize(moved) >= (400 << PAGE_SHIFT)));
+	ConcurrentFree(moved);
+	ConcurrentFree((char*)below < (char*)above ? above : below);
+}
+
+void static TestHugePages()
+{
+	bool enabled = SystemAllocator::HugePages();
+	SystemAllocator::SetHugePages(true);
+	// 缓存的大对象映射不按大页还给系统，先清掉
+	LargeCache::GetInstence()->Release((size_t)-1);
+
+	// 全部释放后，还给系统的只有整个空闲的大页
+	std::vector<void*> ptrs;
+	for (size_t i = 0; i < 64; ++i)
+		ptrs.push_back(ConcurrentAlloc(100 << PAGE_SHIFT));
+	for (void* ptr : ptrs)
+		ConcurrentFree(ptr);
+	AllocatorStats before = GetStats();
+	size_t released = PageCache::GetInstence()->ReleaseToSystem((size_t)-1);
+	EXPECT_RET_SIZE_T((size_t)1, (size_t)(released > 0));
+	EXPECT_RET_SIZE_T((size_t)1, (size_t)(released <= before._pagefreebytes - before._pagereleasedbytes));
+
+	// 大页里其他span已经还过了，再还只算新释放的这个span(128页的span不会和邻居合并)
+	// 跨大页的span先拿着不放，换一个完整落在一个大页里的
+	std::vector<void*> crossing;
+	void* ptr = ConcurrentAlloc((NPAGES - 1) << PAGE_SHIFT);
+	while ((((size_t)ptr >> PAGE_SHIFT) & (HUGEPAGE_PAGES - 1)) + NPAGES - 1 > HUGEPAGE_PAGES)
+	{
+		crossing.push_back(ptr);
+		ptr = ConcurrentAlloc((NPAGES - 1) << PAGE_SHIFT);
+	}
+	ConcurrentFree(ptr);
+	//大页里还有别的span在用时一页都不还
+	released = PageCache::GetInstence()->ReleaseToSystem((size_t)-1);
+	EXPECT_RET_SIZE_T((size_t)1, (size_t)(released <= ((NPAGES - 1) << PAGE_SHIFT)));
+	for (void* span : crossing)
+		ConcurrentFree(span);
+
+	SystemAllocator::SetHugePages(enabled);
+}
+
+void static TestLargeCache()
+{
+	LargeCache::GetInstence()->Release((size_t)-1);
+	AllocatorStats before = GetStats();
+
+	// 释放之后再申请差不多大的，直接拿到刚才的映射
+	void* ptr = ConcurrentAlloc(2 << 20);
+	ConcurrentFree(ptr);
+	AllocatorStats cached = GetStats();
+	EXPECT_RET_SIZE_T((size_t)(2 << 20), cached._largecachebytes);
+	EXPECT_RET_SIZE_T(before._inusebytes, cached._inusebytes);
+	void* again = ConcurrentAlloc((2 << 20) - 4096);
+	EXPECT_RET_SIZE_T((size_t)ptr, (size_t)again);
+	EXPECT_RET_SIZE_T((size_t)(2 << 20), ConcurrentUsableSize(again));
+	AllocatorStats hit = GetStats();
+	EXPECT_RET_SIZE_T(before._largecachehits + 1, hit._largecachehits);
+	EXPECT_RET_SIZE_T((size_t)0, hit._largecachebytes);
+
+	// 大得多的不会用小的映射
+	ConcurrentFree(again);
+	void* bigger = ConcurrentAlloc(4 << 20);
+	EXPECT_RET_SIZE_T((size_t)1, (size_t)(bigger != ptr));
+	EXPECT_RET_SIZE_T(hit._largecachemisses + 1, GetStats()._largecachemisses);
+	ConcurrentFree(bigger);
+
+	// 超过上限时最早放进来的先还给系统
+	EXPECT_RET_SIZE_T((size_t)(6 << 20), GetStats()._largecachebytes);
+	size_t limit = LargeCache::Limit();
+	LargeCache::SetLimit(5 << 20);
+	void* third = ConcurrentAlloc(1 << 20);
+	ConcurrentFree(third);
+	EXPECT_RET_SIZE_T((size_t)(5 << 20), GetStats()._largecachebytes);
+	LargeCache::SetLimit(limit);
+
+	// 回收时放得太久的还给系统
+	EXPECT_RET_SIZE_T((size_t)0, LargeCache::GetInstence()->Trim(60 * 1000));
+	EXPECT_RET_SIZE_T((size_t)(5 << 20), LargeCache::GetInstence()->Trim(0));
+	EXPECT_RET_SIZE_T((size_t)0, GetStats()._largecachebytes);
+}
+
+//往cache里释放各种大小的对象，每种count个
+static void FillCache(ThreadCache* cache, size_t count)
+{
+	for (size_t size = 1024; size <= 8 * 1024; size += 128)
+	{
+		for (size_t i = 0; i < count; ++i)
+			cache->Deallocate(ConcurrentAlloc(size), size);
+	}
+}
+
+void static TestCacheBudget()
+{
+	size_t budget = ThreadCache::Budget();
+	ThreadCache* a = new ThreadCache;
+	ThreadCache* b = new ThreadCache;
+	EXPECT_RET_SIZE_T(MIN_THREAD_CACHE, a->MaxBytes());
+
+	// 没有预算了，a只能从别的缓存偷，缓存的字节数跟着上限走
+	ThreadCache::SetBudget(0);
+	EXPECT_RET_SIZE_T((size_t)0, ThreadCache::Unclaimed());
+	FillCache(a, 100);
+	EXPECT_RET_SIZE_T((size_t)1, (size_t)(a->Bytes() <= 2 * a->MaxBytes()));
+	EXPECT_RET_SIZE_T(MIN_THREAD_CACHE, b->MaxBytes());
+
+	// 有预算时上限会变大
+	ThreadCache::SetBudget(budget);
+	FillCache(a, 100);
+	EXPECT_RET_SIZE_T((size_t)1, (size_t)(a->MaxBytes() > MIN_THREAD_CACHE));
+
+	// 预算又没有了，b从a那里偷
+	ThreadCache::SetBudget(0);
+	size_t before = a->MaxBytes();
+	FillCache(b, 100);
+	EXPECT_RET_SIZE_T((size_t)1, (size_t)(b->MaxBytes() > MIN_THREAD_CACHE));
+	EXPECT_RET_SIZE_T((size_t)1, (size_t)(a->MaxBytes() < before));
+
+	delete a;
+	delete b;
+	ThreadCache::SetBudget(budget);
+}
+
+void static TestObjectPool()
+{
+	ObjectPool<Span> pool;
+	Span* span1 = pool.New();
+	Span* span2 = pool.New();
+	EXPECT_RET_SIZE_T(sizeof(Span), (size_t)span2 - (size_t)span1);
+	EXPECT_RET_SIZE_T((size_t)0, span1->_npage);
+
+	// 还回去的对象优先复用
+	pool.Delete(span1);
+	EXPECT_RET_SIZE_T((size_t)span1, (size_t)pool.New());
+}
+
+void static TestTransferCache()
+{
+	TransferCache cache;
+	void* start = nullptr, *end = nullptr;
+	EXPECT_RET_SIZE_T((size_t)0, cache.Remove(start, end, 512, 8));
+
+	void* objs[8];
+	for (size_t i = 0; i + 1 < 8; ++i)
+		objs[i] = &objs[i + 1];
+	objs[7] = nullptr;
+	EXPECT_RET_SIZE_T((size_t)1, (size_t)cache.Insert(&objs[0], &objs[3], 4, 8));
+	// 批量比需要的多时拆开，剩下的留在缓存里
+	EXPECT_RET_SIZE_T((size_t)3, cache.Remove(start, end, 3, 8));
+	EXPECT_RET_SIZE_T((size_t)&objs[0], (size_t)start);
+	EXPECT_RET_SIZE_T((size_t)&objs[2], (size_t)end);
+	EXPECT_RET_SIZE_T((size_t)1, cache.Remove(start, end, 4, 8));
+	EXPECT_RET_SIZE_T((size_t)&objs[3], (size_t)start);
+	EXPECT_RET_SIZE_T((size_t)&objs[3], (size_t)end);
+
+	// 超过字节数上限时放不进去，但空的时候至少能放一批
+	EXPECT_RET_SIZE_T((size_t)1, (size_t)cache.Insert(&objs[4], &objs[5], 2, TRANSFER_CACHE_BYTES));
+	EXPECT_RET_SIZE_T((size_t)0, (size_t)cache.Insert(&objs[6], &objs[7], 2, 8));
+
+	// 放入过之后第一次按空闲回收不取，再没用过才取出全部
+	EXPECT_RET_SIZE_T((size_t)0, cache.RemoveAll(start, true));
+	EXPECT_RET_SIZE_T((size_t)2, cache.RemoveAll(start, true));
+	size_t n = 0;
+	for (void* cur = start; cur != nullptr; cur = NEXT_OBJ(cur))
+		++n;
+	EXPECT_RET_SIZE_T((size_t)2, n);
+	EXPECT_RET_SIZE_T((size_t)0, cache.Count());
+	// 线程退出后还留在transfer cache里的对象，主动回收时还给span
+	std::thread t([]() {
+		std::vector<void*> v;
+		for (size_t i = 0; i < 20 * SizeClass::NumMoveSize(1024); ++i)
+			v.push_back(ConcurrentAlloc(1024));
+		for (void* ptr : v)
+			ConcurrentFree(ptr, 1024);
+	});
+	t.join();
+	PageCache::GetInstence()->ReleaseToSystem((size_t)-1);
+	EXPECT_RET_SIZE_T((size_t)0, GetStats()._transferbytes);
+}
+
+//中心缓存的span分出去、并且不在transfer cache里的对象个数，也就是在线程缓存和用户手里的
+//从中心缓存取出来再全部还回去之后不变，全部空闲的span还给PageCache也不影响它
+static size_t CentralHeld(size_t index)
+{
+	SizeClassStats stats;
+	CentralCache::Getinstence()->GetClassStats(index, stats);
+	size_t capacity = (SizeClass::ClassNumPage(index) << PAGE_SHIFT) / SizeClass::Size(index);
+	return stats._spans * capacity - stats._centralfree - stats._transfercached;
+}
+
+void static TestBitmapSpan()
+{
+	bool enabled = CentralCache::BitmapSpans();
+	size_t size = SizeClass::Roundup(3000);
+	size_t index = SizeClass::Index(size);
+	for (size_t mode = 0; mode < 2; ++mode)
+	{
+		CentralCache::SetBitmapSpans(mode == 1);
+		size_t before = CentralHeld(index);
+
+		// 一直取到新切出来的span，它的方式跟着开关走
+		std::vector<void*> objs;
+		Span* span = nullptr;
+		while (objs.size() < 10000 && (span == nullptr || span->_bitmapmode != (mode == 1)))
+		{
+			void* start = nullptr, *end = nullptr;
+			size_t n = CentralCache::Getinstence()->FetchRangeObj(start, end, 8, size);
+			for (void* cur = start; n > 0; --n, cur = NEXT_OBJ(cur))
+				objs.push_back(cur);
+			span = PageCache::GetInstence()->MapObjectToSpan(objs.back());
+		}
+		EXPECT_RET_SIZE_T(mode, (size_t)span->_bitmapmode);
+
+		// 取到的对象互不重复，都在对象的边界上
+		std::vector<void*> sorted(objs);
+		std::sort(sorted.begin(), sorted.end());
+		EXPECT_RET_SIZE_T((size_t)1, (size_t)(std::adjacent_find(sorted.begin(), sorted.end()) == sorted.end()));
+		size_t misaligned = 0;
+		for (void* obj : objs)
+		{
+			Span* owner = PageCache::GetInstence()->MapObjectToSpan(obj);
+			misaligned += ((char*)obj - (char*)(owner->_pageid << PAGE_SHIFT)) % size != 0;
+		}
+		EXPECT_RET_SIZE_T((size_t)0, misaligned);
+
+		// 全部还回去之后和之前一样
+		std::vector<bool> bitmapobjs;
+		for (void* obj : objs)
+			bitmapobjs.push_back(PageCache::GetInstence()->MapObjectToSpan(obj)->_bitmapmode);
+		for (size_t i = 0; i + 1 < objs.size(); ++i)
+			NEXT_OBJ(objs[i]) = objs[i + 1];
+		NEXT_OBJ(objs.back()) = nullptr;
+		CentralCache::Getinstence()->ReleaseListToSpans(objs[0], size);
+		EXPECT_RET_SIZE_T(before, CentralHeld(index));
+
+		// 还给位图模式span的对象，内存没有被改写
+		size_t touched = 0;
+		for (size_t i = 0; i + 1 < objs.size(); ++i)
+			touched += bitmapobjs[i] && NEXT_OBJ(objs[i]) != objs[i + 1];
+		EXPECT_RET_SIZE_T((size_t)0, touched);
+	}
+	CentralCache::SetBitmapSpans(enabled);
+}
+
+void static TestReleaseGroups()
+{
+	// 每个span只有一个对象，一次还回去的span比RELEASE_GROUPS多，中途要先还一部分
+	size_t size = SizeClass::Roundup(40 * 1024);
+	size_t index = SizeClass::Index(size);
+	SizeClassStats before;
+	CentralCache::Getinstence()->GetClassStats(index, before);
+	size_t heldbefore = CentralHeld(index);
+
+	std::vector<void*> objs;
+	while (objs.size() < 2 * RELEASE_GROUPS)
+	{
+		void* start = nullptr, *end = nullptr;
+		size_t n = CentralCache::Getinstence()->FetchRangeObj(start, end, 4, size);
+		for (void* cur = start; n > 0; --n, cur = NEXT_OBJ(cur))
+			objs.push_back(cur);
+	}
+	// 不同span的对象交错着还回去
+	std::vector<void*> order;
+	for (size_t i = 0; i < objs.size(); i += 2)
+		order.push_back(objs[i]);
+	for (size_t i = 1; i < objs.size(); i += 2)
+		order.push_back(objs[i]);
+	for (size_t i = 0; i + 1 < order.size(); ++i)
+		NEXT_OBJ(order[i]) = order[i + 1];
+	NEXT_OBJ(order.back()) = nullptr;
+	CentralCache::Getinstence()->ReleaseListToSpans(order[0], size);
+
+	SizeClassStats after;
+	CentralCache::Getinstence()->GetClassStats(index, after);
+	EXPECT_RET_SIZE_T(heldbefore, CentralHeld(index));
+	EXPECT_RET_SIZE_T((size_t)1, (size_t)(after._spans <= before._spans));
+}
+
+void static TestCpuCache()
+{
+	// 绕过线程缓存，直接通过每个CPU的缓存申请和释放
+	std::vector<void*> v;
+	for (size_t i = 0; i < 100; ++i)
+	{
+		v.push_back(CpuCache::GetInstence()->Allocate(TESTALLOCSIZE));
+	}
+	for (size_t i = 0; i < 100; ++i)
+	{
+		EXPECT_RET_SIZE_T(SizeClass::Roundup(TESTALLOCSIZE), PageCache::GetInstence()->MapObjectToSpan(v[i])->_objsize);
+		CpuCache::GetInstence()->Deallocate(v[i], TESTALLOCSIZE);
+	}
+}
+
+void static TestPageShard()
+{
+	// 多个线程同时从各自的分片申请和释放页，span不会跨区域，也就不会被别的分片合并
+	std::atomic<size_t> bad(0);
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < 4; ++t)
+	{
+		threads.push_back(std::thread([&bad, t]() {
+			std::vector<void*> v;
+			for (size_t i = 0; i < 200; ++i)
+			{
+				size_t npage = 17 + (i * 7 + t) % 100;
+				void* ptr = ConcurrentAlloc(npage << PAGE_SHIFT);
+				Span* span = PageCache::GetInstence()->MapObjectToSpan(ptr);
+				if (span->_shard >= NSHARDS || span->_npage != npage
+					|| !SystemAllocator::SameRegion(span->_pageid, span->_pageid + span->_npage - 1))
+					++bad;
+				v.push_back(ptr);
+				if (i % 3 == 0)
+				{
+					ConcurrentFree(v.front());
+					v.erase(v.begin());
+				}
+			}
+			for (void* ptr : v)
+				ConcurrentFree(ptr);
+		}));
+	}
+	for (auto& th : threads)
+		th.join();
+	EXPECT_RET_SIZE_T((size_t)0, bad.load());
+}
+
+void static TestStats()
+{
+	size_t index = SizeClass::Index(1000);
+	AllocatorStats before = GetStats();
+	std::vector<void*> v;
+	for (size_t i = 0; i < 100; ++i)
+		v.push_back(ConcurrentAlloc(1000));
+
+	AllocatorStats during = GetStats();
+	EXPECT_RET_SIZE_T((size_t)100, during._classes[index]._allocs - before._classes[index]._allocs);
+	EXPECT_RET_SIZE_T((size_t)1, (size_t)(during._inusebytes >= before._inusebytes + 100 * SizeClass::Size(index)));
+	EXPECT_RET_SIZE_T((size_t)1, (size_t)(during._mappedbytes >= during._spanbytes + during._hugebytes));
+
+	for (void* ptr : v)
+		ConcurrentFree(ptr);
+
+	AllocatorStats after = GetStats();
+	EXPECT_RET_SIZE_T((size_t)100, after._classes[index]._frees - before._classes[index]._frees);
+	EXPECT_RET_SIZE_T(after._classes[index]._allocs, after._classes[index]._hits + after._classes[index]._misses);
+	EXPECT_RET_SIZE_T(before._inusebytes, after._inusebytes);
+}
+
+//Dump输出的第一行里所有活着的采样的总字节数
+static size_t SampledBytes(HeapProfiler* profiler)
+{
+	FILE* out = tmpfile();
+	profiler->Dump(out);
+	rewind(out);
+	size_t count = 0, bytes = 0;
+	if (fscanf(out, "heap profile: %zu: %zu", &count, &bytes) != 2)
+		bytes = 0;
+	fclose(out);
+	return bytes;
+}
+
+void static TestHeapProfiler()
+{
+	// 采样率为1字节时每次申请都会被采样，释放后记录随之删除
+	HeapProfiler* profiler = HeapProfiler::GetInstence();
+	size_t rate = profiler->SampleRate();
+	size_t live = profiler->LiveSamples();
+	profiler->SetSampleRate(1);
+
+	std::vector<void*> v;
+	for (size_t i = 0; i < 10; ++i)
+		v.push_back(ConcurrentAlloc(100 + i * 1000));
+	v.push_back(ConcurrentAlloc(65 << PAGE_SHIFT));
+	EXPECT_RET_SIZE_T(live + 11, profiler->LiveSamples());
+
+	FILE* out = tmpfile();
+	profiler->Dump(out);
+	EXPECT_RET_SIZE_T((size_t)1, (size_t)(ftell(out) > 0));
+	fclose(out);
+
+	// 原地realloc时采样记录的大小也跟着变
+	size_t before = SampledBytes(profiler);
+	EXPECT_RET_SIZE_T((size_t)v[0], (size_t)ConcurrentRealloc(v[0], 60));
+	EXPECT_RET_SIZE_T(live + 11, profiler->LiveSamples());
+	EXPECT_RET_SIZE_T(before - 40, SampledBytes(profiler));
+
+	profiler->SetSampleRate(rate);
+	for (size_t i = 0; i < v.size(); ++i)
+		ConcurrentFree(v[i]);
+	EXPECT_RET_SIZE_T(live, profiler->LiveSamples());
+}
+
+void static TestTrace()
+{
+	// 每条申请记录至少3字节，释放记录至少2字节，文件头8字节，每个块头16字节
+	const char* path = "unittest.trace";
+	EXPECT_RET_SIZE_T((size_t)1, (size_t)TraceRecorder::Start(path));
+	EXPECT_RET_SIZE_T((size_t)0, (size_t)TraceRecorder::Start(path));
+	for (size_t i = 0; i < 100; ++i)
+		ConcurrentFree(ConcurrentAlloc(i + 1));
+	TraceRecorder::Stop();
+	EXPECT_RET_SIZE_T((size_t)0, (size_t)TraceRecorder::Enabled());
+
+	FILE* fp = fopen(path, "rb");
+	char magic[sizeof(TRACE_MAGIC)] = {};
+	EXPECT_RET_SIZE_T(sizeof(magic), fread(magic, 1, sizeof(magic), fp));
+	EXPECT_RET_SIZE_T((size_t)0, (size_t)memcmp(magic, TRACE_MAGIC, sizeof(magic)));
+	fseek(fp, 0, SEEK_END);
+	EXPECT_RET_SIZE_T((size_t)1, (size_t)(ftell(fp) >= (long)(sizeof(magic) + 16 + 100 * 5)));
+	fclose(fp);
+	remove(path);
+}
+
 void static AllocBig()
 {
 	void* ptr1 = ConcurrentAlloc(65 << PAGE_SHIFT);
@@ -145,6 +841,28 @@ void static AllocBig()
 void static test()
 {
 	TestSize();
+	TestSizeTable();
+	TestPageMap();
+	TestPageAlign();
+	TestScavenge();
+	TestThreadExit();
+	TestSizedFree();
+	TestTypedAlloc();
+	TestBatch();
+	TestAligned();
+	TestRealloc();
+	TestHugePages();
+	TestLargeCache();
+	TestCacheBudget();
+	TestObjectPool();
+	TestTransferCache();
+	TestBitmapSpan();
+	TestReleaseGroups();
+	TestCpuCache();
+	TestPageShard();
+	TestStats();
+	TestHeapProfiler();
+	TestTrace();
 	//Alloc(2,4*1024);
 	//TestThreadCache();
 	//TestCentralCache();
@@ -38,6 +38,9 @@ public:
   static void deallocate(T* ptr);
   static void deallocate(T* ptr, size_type n);
 
+  // reallocate 把 allocate(old_n) 得到的空间扩大到 new_n 个元素，只能用于可以按字节复制的类型
+  static T*   reallocate(T* ptr, size_type old_n, size_type new_n);
+
   // 调用 construct.h中实现的construct函数
   static void construct(T* ptr);
   static void construct(T* ptr, const T& value);
@@ -56,7 +59,7 @@ template <class T>
 T* allocator<T>::allocate()
 {
 #ifdef USE_ALLOCTOR_MEM
-  return static_cast<T*>(ConcurrentAlloc(sizeof(T)));
+  return ConcurrentAllocT<T>();
 #else
   return static_cast<T*>(::operator new(sizeof(T)));
 #endif
@@ -68,12 +71,16 @@ T* allocator<T>::allocate(size_type n)
   if (n == 0)
     return nullptr;
 #ifdef USE_ALLOCTOR_MEM
+  // 容器申请节点时 n 是常量 1，内联后直接走编译期算好大小的版本
+  if (n == 1)
+    return ConcurrentAllocT<T>();
   return static_cast<T*>(ConcurrentAlloc(n * sizeof(T)));
 #else
   return static_cast<T*>(::operator new(n * sizeof(T)));
 #endif
 }
 
+// 不带大小的版本也被用来释放数组(如 basic_string)，所以不能假设大小为 sizeof(T)
 template <class T>
 void allocator<T>::deallocate(T* ptr)
 {
@@ -86,18 +93,43 @@ void allocator<T>::deallocate(T* ptr)
 #endif
 }
 
+// n 必须和 allocate(n) 时相同，内存池可以直接由大小找到自由链表
 template <class T>
-void allocator<T>::deallocate(T* ptr, size_type /*size*/)
+void allocator<T>::deallocate(T* ptr, size_type n)
 {
   if (ptr == nullptr)
     return;
 #ifdef USE_ALLOCTOR_MEM
-  ConcurrentFree(static_cast<void*>(ptr));
+  if (n == 1)
+    ConcurrentFreeT<T>(ptr);
+  else
+    ConcurrentFree(static_cast<void*>(ptr), n * sizeof(T));
 #else
+  (void)n;
   ::operator delete(ptr);
 #endif
 }
 
+// 内存池可以原地扩展时不需要复制，否则由内存池申请新的空间并复制
+template <class T>
+T* allocator<T>::reallocate(T* ptr, size_type old_n, size_type new_n)
+{
+  static_assert(std::is_trivially_copyable<T>::value, "reallocate requires a trivially copyable type");
+  assert(new_n >= old_n);
+#ifdef USE_ALLOCTOR_MEM
+  (void)old_n;
+  return static_cast<T*>(ConcurrentRealloc(static_cast<void*>(ptr), new_n * sizeof(T)));
+#else
+  T* tmp = allocate(new_n);
+  if (ptr != nullptr)
+  {
+    memcpy(tmp, ptr, old_n * sizeof(T));
+    ::operator delete(ptr);
+  }
+  return tmp;
+#endif
+}
+
 template <class T>
 void allocator<T>::construct(T* ptr)
 {
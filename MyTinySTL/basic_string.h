@@ -1621,7 +1621,7 @@ try_init() noexcept
   {
     buffer_ = data_allocator::allocate(static_cast<size_type>(STRING_INIT_SIZE));
     size_ = 0;
-    cap_ = 0;
+    cap_ = static_cast<size_type>(STRING_INIT_SIZE);
   }
   catch (...)
   {
@@ -1888,10 +1888,7 @@ void basic_string<CharType, CharTraits>::
 reallocate(size_type need)
 {
   const auto new_cap = mystl::max(cap_ + need, cap_ + (cap_ >> 1)); // 计算新的容量
-  auto new_buffer = data_allocator::allocate(new_cap);
-  char_traits::move(new_buffer, buffer_, size_);
-  data_allocator::deallocate(buffer_);
-  buffer_ = new_buffer;
+  buffer_ = data_allocator::reallocate(buffer_, cap_, new_cap); // 字符可以按字节复制，交给分配器原地扩展
   cap_ = new_cap;
 }
 
@@ -1343,7 +1343,7 @@ create_node(Args&& ...args)
   }
   catch (...)
   {
-    node_allocator::deallocate(tmp);
+    node_allocator::deallocate(tmp, 1);
     throw;
   }
   return tmp;
@@ -1355,7 +1355,7 @@ void hashtable<T, Hash, KeyEqual>::
 destroy_node(node_ptr node)
 {
   data_allocator::destroy(mystl::address_of(node->value));
-  node_allocator::deallocate(node);
+  node_allocator::deallocate(node, 1);
   node = nullptr;
 }
 
@@ -313,7 +313,7 @@ public:
     if (node_)
     {
       clear();
-      base_allocator::deallocate(node_);
+      base_allocator::deallocate(node_, 1);
       node_ = nullptr;
       size_ = 0;
     }
@@ -858,7 +858,7 @@ list<T>::create_node(Args&& ...args)
   }
   catch (...)
   {
-    node_allocator::deallocate(p);
+    node_allocator::deallocate(p, 1);
     throw;
   }
   return p;
@@ -869,7 +869,7 @@ template <class T>
 void list<T>::destroy_node(node_ptr p)
 {
   data_allocator::destroy(mystl::address_of(p->value)); // destroy负责调用析构函数
-  node_allocator::deallocate(p);                        // deallocate负责释放内存
+  node_allocator::deallocate(p, 1);                     // deallocate负责释放内存
 }
 
 // 用 n 个元素初始化容器
@@ -890,7 +890,7 @@ void list<T>::fill_init(size_type n, const value_type& value)
   catch (...)
   {
     clear();
-    base_allocator::deallocate(node_);
+    base_allocator::deallocate(node_, 1);
     node_ = nullptr;
     throw;
   }
@@ -916,7 +916,7 @@ void list<T>::copy_init(Iter first, Iter last)
   catch (...)
   {
     clear();
-    base_allocator::deallocate(node_);
+    base_allocator::deallocate(node_, 1);
     node_ = nullptr;
     throw;
   }
@@ -1444,7 +1444,7 @@ create_node(Args&&... args)
   }
   catch (...)
   {
-    node_allocator::deallocate(tmp);
+    node_allocator::deallocate(tmp, 1);
     throw;
   }
   return tmp;
@@ -1469,7 +1469,7 @@ void rb_tree<T, Compare>::
 destroy_node(node_ptr p)
 {
   data_allocator::destroy(&p->value);
-  node_allocator::deallocate(p);
+  node_allocator::deallocate(p, 1);
 }
 
 // 初始化容器
@@ -308,6 +308,8 @@ private:
 
   // reallocate
 
+  void      grow(size_type new_cap, std::true_type);
+  void      grow(size_type new_cap, std::false_type);
   template <class... Args>
   void      reallocate_emplace(iterator pos, Args&& ...args);
   void      reallocate_insert(iterator pos, const value_type& value);
@@ -347,7 +349,7 @@ vector<T>& vector<T>::operator=(const vector& rhs)
     { 
       mystl::copy(rhs.begin(), rhs.begin() + size(), begin_);
       mystl::uninitialized_copy(rhs.begin() + size(), rhs.end(), end_);
-      cap_ = end_ = begin_ + len;
+      end_ = begin_ + len;
     }
   }
   return *this;
@@ -375,13 +377,7 @@ void vector<T>::reserve(size_type n)
   {
     THROW_LENGTH_ERROR_IF(n > max_size(),
                           "n can not larger than max_size() in vector<T>::reserve(n)");
-    const auto old_size = size();
-    auto tmp = data_allocator::allocate(n);
-    mystl::uninitialized_move(begin_, end_, tmp);
-    data_allocator::deallocate(begin_, cap_ - begin_);
-    begin_ = tmp;
-    end_ = tmp + old_size;
-    cap_ = begin_ + n;
+    grow(n, std::is_trivially_copyable<T>{});
   }
 }
 
@@ -709,12 +705,43 @@ copy_assign(FIter first, FIter last, forward_iterator_tag)
   }
 }
 
+// grow 函数
+// 元素可以按字节复制时，直接交给分配器的 reallocate，内存池能原地扩展时不需要搬运元素
+template <class T>
+void vector<T>::grow(size_type new_cap, std::true_type)
+{
+  const auto old_size = size();
+  begin_ = data_allocator::reallocate(begin_, capacity(), new_cap);
+  end_ = begin_ + old_size;
+  cap_ = begin_ + new_cap;
+}
+
+template <class T>
+void vector<T>::grow(size_type new_cap, std::false_type)
+{
+  const auto old_size = size();
+  auto tmp = data_allocator::allocate(new_cap);
+  mystl::uninitialized_move(begin_, end_, tmp);
+  data_allocator::deallocate(begin_, cap_ - begin_);
+  begin_ = tmp;
+  end_ = tmp + old_size;
+  cap_ = begin_ + new_cap;
+}
+
 // 重新分配空间并在 pos 处就地构造元素
 template <class T>
 template <class ...Args>
 void vector<T>::
 reallocate_emplace(iterator pos, Args&& ...args)
 {
+  if (pos == end_ && std::is_trivially_copyable<T>::value)
+  { // 在尾部构造时先构造出元素(参数可能引用旧空间里的元素)，再原地扩容
+    value_type value(mystl::forward<Args>(args)...);
+    grow(get_new_cap(1), std::is_trivially_copyable<T>{});
+    data_allocator::construct(mystl::address_of(*end_), mystl::move(value));
+    ++end_;
+    return;
+  }
   const auto new_size = get_new_cap(1);
   auto new_begin = data_allocator::allocate(new_size);
   auto new_end = new_begin;
@@ -740,6 +767,14 @@ reallocate_emplace(iterator pos, Args&& ...args)
 template <class T>
 void vector<T>::reallocate_insert(iterator pos, const value_type& value)
 {
+  if (pos == end_ && std::is_trivially_copyable<T>::value)
+  { // value 可能就在旧空间里，先复制一份再原地扩容
+    const value_type value_copy = value;
+    grow(get_new_cap(1), std::is_trivially_copyable<T>{});
+    data_allocator::construct(mystl::address_of(*end_), value_copy);
+    ++end_;
+    return;
+  }
   const auto new_size = get_new_cap(1);
   auto new_begin = data_allocator::allocate(new_size);
   auto new_end = new_begin;